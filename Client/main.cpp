@@ -50,6 +50,32 @@ void start() {
 		installerUi ui(heapPath, installPath, heapURL, version, product);
 		ui.setExceptions(exc);
 		ui.setExe(arg("exe"));
+		if (param.hasKey("Threads"))ui.setThreads(param["Threads"].ToInt());
+		if (param.hasKey("MinConnections") && param.hasKey("MaxConnections")) {
+			ui.setConnections(param["MinConnections"].ToInt(), param["MaxConnections"].ToInt());
+		}
+		if (param.hasKey("DownloadOrder")) {
+			std::string order = param["DownloadOrder"].ToString();
+			if (order == "fifo")ui.setDownloadOrder(downloader::queue::fifo);
+			else if (order == "largest")ui.setDownloadOrder(downloader::queue::largest_first);
+			else if (order == "smallest")ui.setDownloadOrder(downloader::queue::smallest_first);
+		}
+		if (param.hasKey("Mirrors")) {
+			std::vector<std::string> mirrors;
+			json::JSON& arr = param["Mirrors"];
+			for (int i = 0; i < arr.size(); i++) {
+				std::string m = arr.at(i).ToString();
+				if (!m.empty())mirrors.push_back(m);
+			}
+			/// "MirrorRace" is the amount of KB to race the mirrors with
+			ui.setMirrors(mirrors, param.hasKey("MirrorRace") ? size_t(param["MirrorRace"].ToInt()) * 1024 : 0);
+		}
+		if (param.hasKey("RateLimit"))ui.setRateLimit(size_t(param["RateLimit"].ToInt()) * 1024);
+		if (param.hasKey("SegmentSize"))ui.setSegmentSize(size_t(param["SegmentSize"].ToInt()) * 1024 * 1024);
+		if (param.hasKey("DirectInstall")) {
+			/// "KeepHeap": false leaves the heap without the directly installed files
+			ui.setDirectInstall(param["DirectInstall"].ToBool(), !param.hasKey("KeepHeap") || param["KeepHeap"].ToBool());
+		}
 		ui.start();
 	}
 }
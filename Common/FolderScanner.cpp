@@ -0,0 +1,301 @@
+#include "HeapFilesSync.h"
+#include "FolderScanner.h"
+#include "tasks.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace fheap {
+	/// the buffer for one batch of the folder entries
+	static const size_t listBufferSize = 1 << 16;
+#ifdef __linux__
+	/// the record returned by getdents64, glibc does not declare it
+	struct linuxDirent {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+	static const unsigned int statxMask = STATX_TYPE | STATX_MTIME | STATX_CTIME | STATX_INO | STATX_SIZE;
+#endif
+}
+
+fheap::FolderScanner::FolderScanner() {
+	skip = nullptr;
+	pending = 0;
+	queued = 0;
+	stopped = false;
+	clockOffset = 0;
+}
+
+fheap::FolderScanner::~FolderScanner() {
+	stop();
+}
+
+void fheap::FolderScanner::start(const std::filesystem::path& root, size_t threads_count, const jcc::wild_matcher* skip,
+	std::function<void(folderEntry&)> sink, std::function<void()> finished) {
+	stop();
+	this->skip = skip;
+	this->sink = std::move(sink);
+	this->finished = std::move(finished);
+	stopped = false;
+	error.clear();
+#ifdef __linux__
+	/// statx gives the system time, the cache and the image keep the file clock time, the offset is taken once from the root folder
+	struct statx sx;
+	std::error_code ec;
+	auto wt = std::filesystem::last_write_time(root, ec);
+	if (!ec && statx(AT_FDCWD, root.c_str(), 0, STATX_MTIME, &sx) == 0) {
+		clockOffset = std::chrono::duration_cast<std::chrono::nanoseconds>(wt.time_since_epoch()).count() -
+			(int64_t(sx.stx_mtime.tv_sec) * 1000000000 + sx.stx_mtime.tv_nsec);
+	}
+#endif
+	threads_count = tasks::pool::concurrency(threads_count);
+	queues.clear();
+	for (size_t i = 0; i < threads_count; i++) {
+		queues.emplace_back(new queue);
+	}
+	folder r;
+	r.path = root;
+	if (skip)r.state = skip->start();
+	pending = 1;
+	queued = 1;
+	queues[0]->folders.push_back(std::move(r));
+	for (size_t i = 0; i < threads_count; i++) {
+		threads.emplace_back([this, i] { work(i); });
+	}
+}
+
+void fheap::FolderScanner::stop() {
+	stopped = true;
+	{
+		std::scoped_lock lock(idleLock);
+	}
+	idle.notify_all();
+	for (auto& t : threads) t.join();
+	threads.clear();
+}
+
+std::string fheap::FolderScanner::lastError() {
+	std::scoped_lock lock(errorLock);
+	return error;
+}
+
+void fheap::FolderScanner::work(size_t index) {
+	folder f;
+	while (!stopped) {
+		if (take(index, f)) {
+			list(index, f);
+			if (--pending == 0) {
+				{
+					std::scoped_lock lock(idleLock);
+				}
+				idle.notify_all();
+				if (finished && !stopped)finished();
+				break;
+			}
+		}
+		else {
+			/// the changes of the counters are followed by the notification under idleLock, so the wakeup is never lost
+			std::unique_lock lock(idleLock);
+			idle.wait(lock, [this] { return queued > 0 || pending == 0 || stopped; });
+			if (pending == 0)break;
+		}
+	}
+}
+
+bool fheap::FolderScanner::take(size_t index, folder& f) {
+	{
+		/// the own queue is used as the stack, so the worker goes deep and keeps the queue short
+		std::scoped_lock lock(queues[index]->lock);
+		auto& q = queues[index]->folders;
+		if (!q.empty()) {
+			f = std::move(q.back());
+			q.pop_back();
+			queued--;
+			return true;
+		}
+	}
+	/// steal the oldest folder of the other worker, it is the closest to the root, so most probably has the biggest subtree
+	for (size_t k = 1; k < queues.size(); k++) {
+		queue& other = *queues[(index + k) % queues.size()];
+		std::scoped_lock lock(other.lock);
+		if (!other.folders.empty()) {
+			f = std::move(other.folders.front());
+			other.folders.pop_front();
+			queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void fheap::FolderScanner::push(size_t index, folder&& f) {
+	pending++;
+	{
+		std::scoped_lock lock(queues[index]->lock);
+		queues[index]->folders.push_back(std::move(f));
+	}
+	queued++;
+	{
+		std::scoped_lock lock(idleLock);
+	}
+	idle.notify_one();
+}
+
+void fheap::FolderScanner::found(size_t index, const folder& parent, const std::string& name, folderEntry& e, bool descend) {
+	jcc::wild_matcher::state s;
+	bool add = true;
+	if (skip) {
+		s = parent.state;
+		skip->feed(s, name);
+		add = !skip->matches(s);
+	}
+	if (e.folder && descend) {
+		if (skip)skip->feed(s, "/");
+		if (!skip || !skip->matchesAnyTail(s)) {
+			folder sub;
+			sub.path = e.path;
+			sub.rel = parent.rel + name + char(std::filesystem::path::preferred_separator);
+			sub.state = std::move(s);
+			push(index, std::move(sub));
+		}
+	}
+	if (add) {
+		e.rel = parent.rel + name;
+		sink(e);
+	}
+}
+
+void fheap::FolderScanner::list(size_t index, const folder& f) {
+	try {
+#if defined(__linux__)
+		int fd = ::open(f.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			std::scoped_lock lock(errorLock);
+			if (error.empty())error = "Can't open the folder " + f.path.string();
+			return;
+		}
+		std::unique_ptr<char[]> buf(new char[listBufferSize]);
+		long n;
+		try {
+			while (!stopped && (n = syscall(SYS_getdents64, fd, buf.get(), listBufferSize)) > 0) {
+				for (long off = 0; off < n;) {
+					const linuxDirent* d = reinterpret_cast<const linuxDirent*>(buf.get() + off);
+					off += d->d_reclen;
+					const char* name = d->d_name;
+					if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))continue;
+					struct statx sx;
+					bool link = d->d_type == DT_LNK;
+					if (d->d_type == DT_UNKNOWN) {
+						if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &sx) != 0)continue;
+						link = S_ISLNK(sx.stx_mode);
+					}
+					/// the links are followed like std::filesystem::is_regular_file does, but the linked folders are not descended
+					if (statx(fd, name, link ? 0 : AT_SYMLINK_NOFOLLOW, statxMask, &sx) != 0)continue;
+					folderEntry e;
+					e.folder = S_ISDIR(sx.stx_mode);
+					if (!e.folder && !S_ISREG(sx.stx_mode))continue;
+					e.path = f.path / name;
+					e.mtime = int64_t(sx.stx_mtime.tv_sec) * 1000000000 + sx.stx_mtime.tv_nsec + clockOffset;
+					if (!e.folder) {
+						e.size = size_t(sx.stx_size);
+						e.inode = sx.stx_ino;
+						e.ctime = int64_t(sx.stx_ctime.tv_sec) * 1000000000 + sx.stx_ctime.tv_nsec;
+					}
+					found(index, f, name, e, !link);
+				}
+			}
+		}
+		catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+#elif defined(_WIN32)
+		HANDLE h = CreateFileW(f.path.wstring().c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+		if (h == INVALID_HANDLE_VALUE) {
+			std::scoped_lock lock(errorLock);
+			if (error.empty())error = "Can't open the folder " + f.path.string();
+			return;
+		}
+		/// the entries are 8-byte aligned
+		std::unique_ptr<uint64_t[]> buf(new uint64_t[listBufferSize / sizeof(uint64_t)]);
+		try {
+			FILE_INFO_BY_HANDLE_CLASS cls = FileIdBothDirectoryRestartInfo;
+			while (!stopped && GetFileInformationByHandleEx(h, cls, buf.get(), DWORD(listBufferSize))) {
+				cls = FileIdBothDirectoryInfo;
+				const FILE_ID_BOTH_DIR_INFO* info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(buf.get());
+				do {
+					std::wstring wname(info->FileName, info->FileNameLength / sizeof(WCHAR));
+					if (wname != L"." && wname != L"..") {
+						folderEntry e;
+						e.path = f.path / wname;
+						bool descend = true;
+						bool valid = true;
+						if (info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+							/// the links are followed like std::filesystem::is_regular_file does, but the linked folders are not descended
+							descend = false;
+							std::error_code ec;
+							auto st = std::filesystem::status(e.path, ec);
+							e.folder = !ec && std::filesystem::is_directory(st);
+							valid = !ec && (e.folder || std::filesystem::is_regular_file(st));
+							if (valid) {
+								e.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::filesystem::last_write_time(e.path, ec).time_since_epoch()).count();
+								if (!e.folder) {
+									e.size = size_t(std::filesystem::file_size(e.path, ec));
+									ScanCache::identity(e.path, e.inode, e.ctime);
+								}
+								valid = !ec;
+							}
+						}
+						else {
+							/// FILETIME ticks are the file clock ticks of 100 ns
+							e.folder = (info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+							e.mtime = info->LastWriteTime.QuadPart * 100;
+							if (!e.folder) {
+								e.size = size_t(info->EndOfFile.QuadPart);
+								e.inode = uint64_t(info->FileId.QuadPart);
+								e.ctime = info->ChangeTime.QuadPart;
+							}
+						}
+						if (valid)found(index, f, e.path.filename().string(), e, descend);
+					}
+					if (!info->NextEntryOffset)break;
+					info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(reinterpret_cast<const char*>(info) + info->NextEntryOffset);
+				} while (true);
+			}
+		}
+		catch (...) {
+			CloseHandle(h);
+			throw;
+		}
+		CloseHandle(h);
+#else
+		for (auto& p : std::filesystem::directory_iterator(f.path)) {
+			if (stopped)break;
+			folderEntry e;
+			e.path = p.path();
+			e.folder = p.is_directory();
+			if (!e.folder && !p.is_regular_file())continue;
+			e.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(p.last_write_time().time_since_epoch()).count();
+			if (!e.folder) {
+				e.size = p.file_size();
+				ScanCache::identity(e.path, e.inode, e.ctime);
+			}
+			found(index, f, e.path.filename().string(), e, !p.is_symlink());
+		}
+#endif
+	}
+	catch (std::exception& ex) {
+		std::scoped_lock lock(errorLock);
+		if (error.empty())error = ex.what();
+	}
+}
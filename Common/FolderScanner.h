@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jcc.h"
+
+namespace fheap {
+	/// The file or the folder found by the FolderScanner
+	struct folderEntry {
+		std::filesystem::path path;
+		/// the path relative to the scanned folder
+		std::string rel;
+		/// modification time, nanoseconds since the file clock epoch (the same as last_write_time gives)
+		int64_t mtime = 0;
+		/// status change time in the system units, 0 if unknown
+		int64_t ctime = 0;
+		/// inode or the file id, 0 if unknown
+		uint64_t inode = 0;
+		size_t size = 0;
+		bool folder = false;
+	};
+
+	/**
+	 * \brief Parallel traversal of the folder tree. Each worker lists its own folders and pushes the subfolders to its own queue,
+	 * the idle workers steal the folders from the queues of the others. The entries are passed to the sink as soon as they are found,
+	 * so the next stage may start working before the traversal ends.
+	 * The folders are listed in batches: getdents64 + statx on Linux, FileIdBothDirectoryInfo on Windows,
+	 * so the sizes, times and the file ids come without opening every file.
+	 */
+	class FolderScanner {
+		struct folder {
+			std::filesystem::path path;
+			std::string rel;
+			jcc::wild_matcher::state state;
+		};
+		struct queue {
+			std::mutex lock;
+			std::deque<folder> folders;
+		};
+		std::vector<std::unique_ptr<queue>> queues;
+		std::vector<std::thread> threads;
+		const jcc::wild_matcher* skip;
+		std::function<void(folderEntry&)> sink;
+		std::function<void()> finished;
+		/// folders queued or being listed
+		std::atomic<size_t> pending;
+		/// folders queued only, the idle workers sleep while there is nothing to steal
+		std::atomic<size_t> queued;
+		std::atomic<bool> stopped;
+		std::mutex idleLock;
+		std::condition_variable idle;
+		std::mutex errorLock;
+		std::string error;
+		/// difference between the file clock and the system time in nanoseconds
+		int64_t clockOffset;
+		void work(size_t index);
+		bool take(size_t index, folder& f);
+		void push(size_t index, folder&& f);
+		void list(size_t index, const folder& f);
+		void found(size_t index, const folder& parent, const std::string& name, folderEntry& e, bool descend);
+	public:
+		FolderScanner();
+		/// Stops and waits the workers
+		~FolderScanner();
+
+		/**
+		 * \brief Start the traversal in the background
+		 * \param root the folder to scan, it is not passed to the sink itself
+		 * \param threads amount of the workers, 0 means the number of the CPU cores
+		 * \param skip the entries that match are not passed to the sink, the folders where everything matches are not listed at all, may be nullptr
+		 * \param sink called from the worker threads for every file and folder found, should be thread-safe and should not throw
+		 * \param finished called once when everything is listed and passed to the sink, not called if stopped
+		 */
+		void start(const std::filesystem::path& root, size_t threads, const jcc::wild_matcher* skip,
+			std::function<void(folderEntry&)> sink, std::function<void()> finished);
+
+		/// Stop the traversal and wait the workers
+		void stop();
+
+		/// The first error met during the traversal, the unreadable folders are skipped
+		std::string lastError();
+	};
+}
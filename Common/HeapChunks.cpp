@@ -0,0 +1,168 @@
+#include "HeapFilesSync.h"
+#include "HeapChunks.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+namespace fheap {
+	/// the smallest average size, the masks below need some bits
+	static const size_t chunkAverageMin = 256;
+
+	/// the random values for every byte, the same sequence everywhere, so the uploader and the clients cut the files at the same places
+	static const std::array<uint64_t, 256>& gearTable() {
+		static const std::array<uint64_t, 256> table = [] {
+			std::array<uint64_t, 256> t;
+			/// splitmix64
+			uint64_t x = 0x41555044415445ULL;
+			for (auto& v : t) {
+				uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				v = z ^ (z >> 31);
+			}
+			return t;
+		}();
+		return table;
+	}
+}
+
+const char* fheap::HeapChunks::folderName = "Chunks";
+
+void fheap::HeapChunks::open(const std::filesystem::path& heapPath) {
+	heap = heapPath;
+}
+
+std::filesystem::path fheap::HeapChunks::listPath(const std::string& hash) const {
+	std::filesystem::path p = heap;
+	p.append(folderName);
+	p.append(hash);
+	return p;
+}
+
+bool fheap::HeapChunks::split(const std::filesystem::path& file, size_t averageSize, const chunkFn& onChunk) {
+	averageSize = std::max(averageSize, chunkAverageMin);
+	const size_t minSize = averageSize / 4;
+	const size_t maxSize = averageSize * 4;
+	int bits = 0;
+	while ((size_t(2) << bits) <= averageSize) bits++;
+	/// the normalized chunking: the cut is harder before the average size and easier after it, so most of the chunks are close to the average.
+	/// The top bits of the gear hash depend on the last 64 bytes, so the mask takes them.
+	const uint64_t maskHard = ~uint64_t(0) << (64 - (bits + 1));
+	const uint64_t maskEasy = ~uint64_t(0) << (64 - (bits - 1));
+	const std::array<uint64_t, 256>& gear = gearTable();
+	auto cut = [&](const uint8_t* src, size_t n) -> size_t {
+		if (n <= minSize)return n;
+		size_t normal = std::min(n, averageSize);
+		size_t limit = std::min(n, maxSize);
+		uint64_t fp = 0;
+		size_t i = minSize;
+		for (; i < normal; i++) {
+			fp = (fp << 1) + gear[src[i]];
+			if (!(fp & maskHard))return i + 1;
+		}
+		for (; i < limit; i++) {
+			fp = (fp << 1) + gear[src[i]];
+			if (!(fp & maskEasy))return i + 1;
+		}
+		return limit;
+	};
+	std::ifstream f(file, std::ios::binary);
+	if (!f.is_open())return false;
+	/// the buffer keeps at least the biggest chunk ahead while the file is not over
+	const size_t bufferSize = maxSize * 2;
+	std::unique_ptr<uint8_t[]> buf(new uint8_t[bufferSize]);
+	size_t start = 0;
+	size_t filled = 0;
+	bool eof = false;
+	while (true) {
+		if (!eof && filled - start < maxSize) {
+			memmove(buf.get(), buf.get() + start, filled - start);
+			filled -= start;
+			start = 0;
+			f.read(reinterpret_cast<char*>(buf.get() + filled), std::streamsize(bufferSize - filled));
+			if (f.bad())return false;
+			filled += size_t(f.gcount());
+			eof = !f;
+		}
+		if (start == filled)break;
+		size_t n = cut(buf.get() + start, filled - start);
+		if (!onChunk(buf.get() + start, n))return false;
+		start += n;
+	}
+	return true;
+}
+
+bool fheap::HeapChunks::add(const std::filesystem::path& file, size_t averageSize, const std::function<std::filesystem::path(const std::string&)>& blobPath,
+	const std::function<bool(chunk&)>& inPack, const std::string& nameInArchive, std::string& hash, std::vector<chunk>& chunks) {
+	static std::atomic<int> idx = 0;
+	chunks.clear();
+	md5::context whole;
+	bool ok = split(file, averageSize, [&](const void* data, size_t length) {
+		whole.update(data, length);
+		chunk c;
+		c.hash = md5::hash(static_cast<const uint8_t*>(data), length);
+		c.length = length;
+		std::filesystem::path zp = blobPath(c.hash);
+		std::error_code ec;
+		if (std::filesystem::exists(zp, ec)) {
+			/// the chunk is the same as in the previous versions
+			c.zhash = md5::file_hash(zp.string());
+			c.size = std::filesystem::file_size(zp, ec);
+			if (c.zhash.length() == 32 && !ec) {
+				chunks.push_back(c);
+				return true;
+			}
+			c.zhash.clear();
+			c.size = 0;
+		}
+		else if (inPack && inPack(c)) {
+			/// the same content is the small file packed before
+			chunks.push_back(c);
+			return true;
+		}
+		/// the blob appears at once, so the other worker with the same content never reads the incomplete one
+		std::filesystem::path temp = zp;
+		temp += "." + std::to_string(++idx) + ".tmp";
+		md5::context archive;
+		bool packed = zpp::packData(data, length, temp.string(), nameInArchive, [&](const void* data, size_t length) {
+			archive.update(data, length);
+			c.size += length;
+		});
+		if (packed)std::filesystem::rename(temp, zp, ec);
+		if (!packed || ec) {
+			std::filesystem::remove(temp, ec);
+			if (!packed || !std::filesystem::exists(zp, ec))return false;
+		}
+		c.zhash = archive.final();
+		chunks.push_back(c);
+		return true;
+	});
+	if (!ok)return false;
+	hash = whole.final();
+	std::filesystem::path lp = listPath(hash);
+	std::filesystem::path temp = lp;
+	temp += "." + std::to_string(++idx) + ".tmp";
+	zpp::createPathForFile(lp.string());
+	std::ofstream f(temp, std::ios::binary | std::ios::trunc);
+	f << averageSize << "\n";
+	for (auto& c : chunks) f << c.hash << " " << c.zhash << " " << c.size << " " << c.length << "\n";
+	f.close();
+	std::error_code ec;
+	if (!f.fail())std::filesystem::rename(temp, lp, ec);
+	if (f.fail() || ec) {
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+bool fheap::HeapChunks::find(const std::string& hash, size_t& averageSize, std::vector<chunk>& chunks) const {
+	std::ifstream f(listPath(hash), std::ios::binary);
+	if (!f.is_open() || !(f >> averageSize))return false;
+	chunks.clear();
+	chunk c;
+	while (f >> c.hash >> c.zhash >> c.size >> c.length) chunks.push_back(c);
+	if (!f.eof() || chunks.empty())return false;
+	return std::all_of(chunks.begin(), chunks.end(), [](const chunk& c) { return c.hash.length() == 32 && c.zhash.length() == 32; });
+}
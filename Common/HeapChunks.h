@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace fheap {
+	/**
+	 * \brief The big files split to the chunks by the content (FastCDC). The boundaries depend only on the bytes around them,
+	 * so the change in the middle of the file changes only the chunks around it, the rest of the chunks are the same as in the previous version.
+	 * Every chunk is stored in the heap as the usual blob named by the md5 of the chunk, the list of the chunks of the file
+	 * is kept in Chunks/<md5 of the file>, so the unchanged file is not split again.
+	 */
+	class HeapChunks {
+	public:
+		/// one chunk of the file
+		struct chunk {
+			/// md5 of the chunk content
+			std::string hash;
+			/// md5 of the blob of the chunk
+			std::string zhash;
+			/// the blob size
+			uint64_t size = 0;
+			/// the chunk size
+			uint64_t length = 0;
+		};
+		/// receives the content of every chunk
+		typedef std::function<bool(const void* data, size_t length)> chunkFn;
+	private:
+		std::filesystem::path heap;
+		std::filesystem::path listPath(const std::string& hash) const;
+	public:
+		/// the folder of the chunk lists inside the heap
+		static const char* folderName;
+
+		/// Use the heap at the path
+		void open(const std::filesystem::path& heapPath);
+
+		/// Split the file to the chunks of averageSize bytes in average, the smallest chunk is averageSize / 4, the biggest one is averageSize * 4.
+		/// Returns false if the file can't be read or onChunk returns false.
+		static bool split(const std::filesystem::path& file, size_t averageSize, const chunkFn& onChunk);
+
+		/**
+		 * \brief Split the file and put the new chunks to the heap, the chunks list is written too.
+		 * \param hash receives md5 of the whole file
+		 * \param blobPath the heap file of the chunk blob
+		 * \param inPack finds the blob of the chunk in the packs and fills its zhash and size, such chunk is not written again
+		 * \param nameInArchive the entry name of the blobs
+		 * Returns false if something failed, the chunks written before are kept, they are the valid blobs.
+		 */
+		bool add(const std::filesystem::path& file, size_t averageSize, const std::function<std::filesystem::path(const std::string&)>& blobPath,
+			const std::function<bool(chunk&)>& inPack, const std::string& nameInArchive, std::string& hash, std::vector<chunk>& chunks);
+
+		/// Read the chunks list of the file with the md5 written by add, returns false if the file was not split
+		bool find(const std::string& hash, size_t& averageSize, std::vector<chunk>& chunks) const;
+	};
+}
@@ -0,0 +1,134 @@
+#include "HeapFilesSync.h"
+#include "HeapDeltas.h"
+
+#include <unordered_map>
+
+namespace fheap {
+	static const char deltaMagic[8] = { 'A', 'U', 'D', 'E', 'L', 'T', 'A', '1' };
+	/// the shortest match that is searched, the base is indexed by the blocks of this size
+	static const size_t deltaBlock = 32;
+	static const uint32_t deltaPrime = 0x01000193;
+	static const size_t deltaBufferSize = 1 << 18;
+	enum deltaOp : uint8_t {
+		/// the new bytes follow
+		addOp = 0,
+		/// the piece of the base
+		copyOp = 1
+	};
+
+	static void putVarint(std::string& s, uint64_t v) {
+		while (v >= 0x80) {
+			s += char((v & 0x7F) | 0x80);
+			v >>= 7;
+		}
+		s += char(v);
+	}
+
+	static bool getVarint(const std::string& s, size_t& pos, uint64_t& v) {
+		v = 0;
+		for (int shift = 0; pos < s.size() && shift < 64; shift += 7) {
+			uint8_t b = uint8_t(s[pos++]);
+			v |= uint64_t(b & 0x7F) << shift;
+			if (!(b & 0x80))return true;
+		}
+		return false;
+	}
+}
+
+const char* fheap::HeapDeltas::folderName = "Deltas";
+const char* fheap::HeapDeltas::skippedName = "skipped_deltas";
+
+std::string fheap::HeapDeltas::blobName(const std::string& base, const std::string& target) {
+	return base + "_" + target;
+}
+
+std::string fheap::HeapDeltas::diff(const std::string& base, const std::string& target) {
+	std::string delta(deltaMagic, sizeof(deltaMagic));
+	putVarint(delta, target.size());
+	const uint8_t* b = reinterpret_cast<const uint8_t*>(base.data());
+	const uint8_t* t = reinterpret_cast<const uint8_t*>(target.data());
+	size_t bn = base.size();
+	size_t tn = target.size();
+	uint32_t power = 1;
+	for (size_t k = 1; k < deltaBlock; k++) power *= deltaPrime;
+	auto hashAt = [](const uint8_t* p) {
+		uint32_t h = 0;
+		for (size_t k = 0; k < deltaBlock; k++) h = h * deltaPrime + p[k];
+		return h;
+	};
+	std::unordered_map<uint32_t, size_t> index;
+	index.reserve(bn / deltaBlock + 1);
+	for (size_t p = 0; p + deltaBlock <= bn; p += deltaBlock) index.try_emplace(hashAt(b + p), p);
+	/// the target bytes from pending are not written yet
+	size_t pending = 0;
+	auto add = [&](size_t end) {
+		if (end <= pending)return;
+		delta += char(addOp);
+		putVarint(delta, end - pending);
+		delta.append(target, pending, end - pending);
+	};
+	size_t i = 0;
+	uint32_t h = tn >= deltaBlock ? hashAt(t) : 0;
+	while (i + deltaBlock <= tn) {
+		auto m = index.find(h);
+		if (m != index.end() && memcmp(b + m->second, t + i, deltaBlock) == 0) {
+			size_t from = m->second;
+			size_t at = i;
+			size_t length = deltaBlock;
+			while (at + length < tn && from + length < bn && t[at + length] == b[from + length]) length++;
+			while (at > pending && from > 0 && t[at - 1] == b[from - 1]) {
+				at--;
+				from--;
+				length++;
+			}
+			add(at);
+			delta += char(copyOp);
+			putVarint(delta, from);
+			putVarint(delta, length);
+			i = pending = at + length;
+			if (i + deltaBlock <= tn)h = hashAt(t + i);
+			continue;
+		}
+		if (i + deltaBlock < tn)h = (h - t[i] * power) * deltaPrime + t[i + deltaBlock];
+		i++;
+	}
+	add(tn);
+	return delta;
+}
+
+bool fheap::HeapDeltas::apply(const std::filesystem::path& base, const std::string& delta, const zpp::data_callback& onData) {
+	if (delta.size() < sizeof(deltaMagic) || memcmp(delta.data(), deltaMagic, sizeof(deltaMagic)) != 0)return false;
+	size_t pos = sizeof(deltaMagic);
+	uint64_t length;
+	if (!getVarint(delta, pos, length))return false;
+	std::ifstream src(base, std::ios::binary);
+	if (!src.is_open())return false;
+	std::unique_ptr<char[]> buf(new char[deltaBufferSize]);
+	uint64_t written = 0;
+	while (pos < delta.size()) {
+		uint8_t op = uint8_t(delta[pos++]);
+		uint64_t n;
+		if (op == addOp) {
+			if (!getVarint(delta, pos, n) || n > delta.size() - pos)return false;
+			onData(delta.data() + pos, size_t(n));
+			pos += size_t(n);
+			written += n;
+		}
+		else if (op == copyOp) {
+			uint64_t from;
+			if (!getVarint(delta, pos, from) || !getVarint(delta, pos, n))return false;
+			src.clear();
+			if (!src.seekg(std::streamoff(from)))return false;
+			while (n) {
+				src.read(buf.get(), std::streamsize(std::min<uint64_t>(n, deltaBufferSize)));
+				std::streamsize got = src.gcount();
+				if (got <= 0)return false;
+				onData(buf.get(), size_t(got));
+				n -= uint64_t(got);
+				written += uint64_t(got);
+			}
+		}
+		else return false;
+	}
+	return written == length;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+#include "zpp.h"
+
+namespace fheap {
+	/**
+	 * \brief The binary deltas between the versions of the same file. The delta is the list of the pieces copied from the base file
+	 * and the new bytes, the base is indexed by the blocks and the target is searched with the rolling hash, the matches are extended both ways.
+	 * The delta is stored in the heap as the usual single-entry archive Deltas/<base md5>_<target md5>, so the new bytes are compressed.
+	 * The delta that gives too small gain is not kept, its name is listed in the local file skippedName of the heap root, so the next runs
+	 * do not make it again. The list is not uploaded with the heap.
+	 */
+	class HeapDeltas {
+	public:
+		/// the folder of the deltas inside the heap
+		static const char* folderName;
+		/// the list of the deltas that are not worth keeping, one name per line
+		static const char* skippedName;
+
+		/// The name of the delta from the base to the target content
+		static std::string blobName(const std::string& base, const std::string& target);
+
+		/// Make the delta that turns the base into the target
+		static std::string diff(const std::string& base, const std::string& target);
+
+		/// Apply the delta to the base file passing the result to onData, returns false if the delta is broken or does not fit the base
+		static bool apply(const std::filesystem::path& base, const std::string& delta, const zpp::data_callback& onData);
+	};
+}
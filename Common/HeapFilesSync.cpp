@@ -5,15 +5,25 @@
 #include "exec.h"
 #include "jcc.h"
 #include "download.h"
+#include "tasks.h"
+#include "FolderScanner.h"
+
+/// the name of the single entry of the heap archives, it does not depend on the content, so the archive is written before the content hash is known
+static const std::string blobEntryName = "content";
+/// the neighbour packed blobs are downloaded by one request if the gap between them is not bigger, the gap is downloaded and skipped
+static const uint64_t packGapMax = 64 * 1024;
+/// the biggest range of the pack downloaded by one request, so the big batch is shared by several connections
+static const uint64_t packRangeMax = 8 * 1024 * 1024;
+/// the file is extracted next to its place in the destination under this suffix and replaces the old one only when it is verified
+static const std::string extractingSuffix = ".extracting";
 
 std::filesystem::path fheap::FilesHeap::temp_unique() {
-	static int idx = 0;
+	static std::atomic<int> idx = 0;
 	std::chrono::microseconds ms = std::chrono::duration_cast<std::chrono::microseconds>(
 		std::chrono::system_clock::now().time_since_epoch());
-	idx++;
 	std::filesystem::path p = _heapPath;
 	std::string s = std::to_string(ms.count());
-	s += "_" + std::to_string(idx);
+	s += "_" + std::to_string(++idx);
 	p.append(s);
 	return p;
 }
@@ -40,6 +50,90 @@ bool fheap::FilesHeap::checkIntegrity(const std::filesystem::path& path, const s
 	}
 }
 
+bool fheap::FilesHeap::assembleChunks(const json::JSON& list, const std::filesystem::path& installed, const std::map<std::string, uint64_t>& local,
+	const std::string& destFilename, const zpp::data_callback& onData) {
+	zpp::createPathForFile(destFilename);
+	std::ofstream f(destFilename, std::ios::binary | std::ios::trunc);
+	if (!f.is_open())return false;
+	std::ifstream src;
+	std::unique_ptr<char[]> buf;
+	for (auto c : list.ArrayRange()) {
+		std::string hash = c["md5"].ToString();
+		uint64_t length = std::strtoull(c["length"].ToString().c_str(), nullptr, 10);
+		md5::context digest;
+		uint64_t written = 0;
+		zpp::data_callback write = [&](const void* data, size_t n) {
+			f.write(static_cast<const char*>(data), n);
+			digest.update(data, n);
+			written += n;
+			if (onData)onData(data, n);
+		};
+		auto l = local.find(hash);
+		if (l != local.end()) {
+			/// the destination file is replaced only after this, so the installed version is still there
+			if (!src.is_open())src.open(installed, std::ios::binary);
+			if (!buf)buf.reset(new char[md5::file_buffer_size]);
+			src.clear();
+			src.seekg(std::streamoff(l->second));
+			uint64_t left = length;
+			while (left && src) {
+				src.read(buf.get(), std::streamsize(std::min<uint64_t>(left, md5::file_buffer_size)));
+				std::streamsize n = src.gcount();
+				if (n <= 0)break;
+				write(buf.get(), size_t(n));
+				left -= uint64_t(n);
+			}
+		}
+		else if (std::filesystem::exists(_path(hash))) {
+			zpp::reader zr(_path(hash).string());
+			if (!zr.extractFirst(write))return false;
+		}
+		else if (!packs.inflate(hash, write))return false;
+		/// the installed file may be changed after it was split, so every chunk is checked
+		if (written != length || digest.final() != hash)return false;
+	}
+	f.close();
+	return !f.fail();
+}
+
+std::filesystem::path fheap::FilesHeap::_deltaPath(const std::string& base, const std::string& hash) {
+	std::filesystem::path p = _heapPath;
+	p.append(HeapDeltas::folderName);
+	p.append(HeapDeltas::blobName(base, hash));
+	return p;
+}
+
+bool fheap::FilesHeap::applyDelta(const std::filesystem::path& installed, const std::string& base, const std::string& hash,
+	const std::string& destFilename, const zpp::data_callback& onData) {
+	std::string delta;
+	zpp::reader zr(_deltaPath(base, hash).string());
+	if (!zr.extractFirst([&delta](const void* data, size_t length) { delta.append(static_cast<const char*>(data), length); }))return false;
+	zpp::createPathForFile(destFilename);
+	std::ofstream f(destFilename, std::ios::binary | std::ios::trunc);
+	if (!f.is_open())return false;
+	bool ok = HeapDeltas::apply(installed, delta, [&](const void* data, size_t length) {
+		f.write(static_cast<const char*>(data), length);
+		if (onData)onData(data, length);
+	});
+	f.close();
+	return ok && !f.fail();
+}
+
+bool fheap::FilesHeap::readBlob(const std::string& hash, std::string& content) {
+	content.clear();
+	auto append = [&content](const void* data, size_t length) {
+		content.append(static_cast<const char*>(data), length);
+	};
+	std::filesystem::path zp = _path(hash);
+	bool ok;
+	if (std::filesystem::exists(zp)) {
+		zpp::reader zr(zp.string());
+		ok = zr.extractFirst(append);
+	}
+	else ok = packs.inflate(hash, append);
+	return ok && md5::hash(reinterpret_cast<const uint8_t*>(content.data()), content.size()) == hash;
+}
+
 std::string progress(size_t n, size_t m) {
 	std::string r = "[";
 	for (size_t k = 0; k < 40; k++) {
@@ -78,6 +172,18 @@ fheap::FilesHeap::FilesHeap() {
 			std::cout << "ERROR! " << stage << " : " << the_problem_to_display << "\n";
 		});
 	log = false;
+	_threads = 0;
+	_segmentSize = 32 * 1024 * 1024;
+	_minConnections = 2;
+	_maxConnections = 32;
+	_downloadOrder = downloader::queue::largest_first;
+	_raceBytes = 0;
+	_directInstall = false;
+	_keepHeap = true;
+	_packBlobs = 0;
+	_bundleSize = 1024 * 1024;
+	_chunkFiles = 0;
+	_chunkSize = 1024 * 1024;
 }
 
 fheap::FilesHeap::~FilesHeap() {
@@ -92,6 +198,27 @@ void fheap::FilesHeap::setErrors(errorsFn fn) {
 	errors = fn;
 }
 
+void fheap::FilesHeap::setThreads(size_t threads) {
+	_threads = threads;
+}
+
+void fheap::FilesHeap::setSegmentSize(size_t size) {
+	_segmentSize = size;
+}
+
+void fheap::FilesHeap::setConnections(size_t min, size_t max) {
+	_minConnections = min;
+	_maxConnections = max;
+}
+
+void fheap::FilesHeap::setDownloadOrder(downloader::queue::policy order) {
+	_downloadOrder = order;
+}
+
+void fheap::FilesHeap::setRateLimit(size_t bytes_per_second) {
+	limiter.setRate(bytes_per_second);
+}
+
 void fheap::FilesHeap::setHeapPlacement(const std::filesystem::path& path) {
 	_heapPath = path;
 	create_directories(path);
@@ -113,9 +240,46 @@ void fheap::FilesHeap::setServer(const std::string& server, const std::string& i
 	_servpath = initialPath;
 }
 
+void fheap::FilesHeap::setMirrors(const std::vector<std::string>& mirrors, size_t raceBytes) {
+	_mirrors = mirrors;
+	_raceBytes = raceBytes;
+}
+
+void fheap::FilesHeap::setDirectInstall(bool direct, bool keepHeap) {
+	_directInstall = direct;
+	_keepHeap = keepHeap;
+}
+
+void fheap::FilesHeap::setPackedBlobs(size_t maxBlobSize, size_t bundleSize) {
+	_packBlobs = maxBlobSize;
+	_bundleSize = bundleSize;
+}
+
+void fheap::FilesHeap::setChunking(size_t minFileSize, size_t averageChunk) {
+	_chunkFiles = minFileSize;
+	_chunkSize = averageChunk;
+}
+
+void fheap::FilesHeap::useMirrors(downloader::queue& q) {
+	if (_mirrors.empty())return;
+	std::vector<std::string> bases = { _servpath };
+	bases.insert(bases.end(), _mirrors.begin(), _mirrors.end());
+	q.setMirrors(bases);
+	q.setRace(_raceBytes);
+}
+
 bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extra_files, bool skipUserBreak, std::vector<std::string>* exceptions) {
 	if (!valid())return false;
 	if (log) std::cout << "\nSyncing the folder: " << _dest << "\n";
+	/// the files left by the interrupted copying are removed before the scan, so they are neither hashed nor taken for the content
+	for (auto [key, item] : image.ObjectRange()) {
+		if (!item.hasKey("md5"))continue;
+		std::filesystem::path temp = _dest;
+		temp.append(key);
+		temp += extractingSuffix;
+		std::error_code ec;
+		std::filesystem::remove(temp, ec);
+	}
 	json::JSON old;
 	if (!createDestFolderImage(old, FALSE, true, exceptions))return false;
 	const std::string md5 = "md5";
@@ -139,6 +303,11 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 		total = t;
 		return progress(cur, total, "", "Downloading");
 	});
+	dq.setSegmentSize(_segmentSize);
+	dq.setAdaptive(_minConnections, _maxConnections);
+	dq.setPolicy(_downloadOrder);
+	dq.setRateLimiter(&limiter);
+	useMirrors(dq);
 
 	auto progressHandler = [&](const std::string& filename, const std::string& stage) -> bool {
 		if (progress) {
@@ -150,6 +319,36 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 		}
 		return false;
 	};
+	/// the keys unzipped by the direct downloads, the copy stage only renames them
+	std::mutex inflatedLock;
+	std::set<std::string> inflated;
+	/// the direct download unzips to the single destination, so the content used by several files goes through the heap
+	std::map<std::string, size_t> uses;
+	if (_directInstall) {
+		for (auto [key, item] : image.ObjectRange()) {
+			if (item.hasKey(md5))uses[item[md5].ToString()]++;
+		}
+	}
+	/// the packed blobs to download by the ranges of each pack
+	struct packedBlob {
+		uint64_t offset;
+		uint64_t length;
+		std::string hash;
+		std::string zhash;
+		int priority;
+		/// the neighbour files of the same folder, empty for the images without the bundles
+		std::string bundle;
+	};
+	std::map<std::string, std::vector<packedBlob>> packedBlobs;
+	/// the chunks of the installed files: the key, the md5 of the chunk, the position in the file
+	std::map<std::string, std::map<std::string, uint64_t>> localChunks;
+	std::set<std::string> queuedChunks;
+	/// the chunked keys in the order of the image, their chunks are queued when the installed files are split
+	std::vector<std::string> chunkedKeys;
+	/// the keys patched by the deltas and the md5 of the installed version, it is the base of the delta
+	std::map<std::string, std::string> deltaBase;
+	std::set<std::string> queuedDeltas;
+	HeapPacks::location where;
 	bool needDownload = false;
 	for (auto [key, item] : image.ObjectRange()) {
 		if (item.hasKey(md5)) {
@@ -163,24 +362,93 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 					exists = true;
 				}
 			}
-			if (!exists && zhashes.count(hash) == 0) { /// the destination file does not exist
+			/// the chunks and the deltas depend on the installed file of every key, so the files with the same content are checked one by one
+			if (!exists && (zhashes.count(hash) == 0 || item.hasKey("chunks") || item.hasKey("deltas"))) { /// the destination file does not exist
 				if(!needDownload) {
 					needDownload = true;
 					if (progress)progress(0, 100, "", "Downloading...");
 				}
 				std::cout << "Need: " << key << "\n";
 				std::filesystem::path dst = _path(hash);
-				if (std::filesystem::exists(dst)) {
+				if (std::filesystem::exists(dst) || packs.find(hash, where)) {
 					/// the file with the hashsumm exists in the heap
 					continue;
 				}
+				if (item.hasKey("deltas") && old.hasKey(key) && old[key].hasKey(md5)) {
+					/// the installed version is patched if there is the delta from it
+					std::string installed = old[key][md5].ToString();
+					for (auto d : item["deltas"].ArrayRange()) {
+						if (d["base"].ToString() != installed)continue;
+						/// the patch needs exactly the base content, the scan may have taken the hash from the cache, so the file itself is checked
+						std::filesystem::path local = _dest;
+						local.append(key);
+						if (md5::file_hash(local.string()) != installed)break;
+						deltaBase[key] = installed;
+						std::string name = HeapDeltas::blobName(installed, hash);
+						std::filesystem::path dp = _deltaPath(installed, hash);
+						if (!std::filesystem::exists(dp) && queuedDeltas.insert(name).second) {
+							size_t dsize = size_t(std::strtoull(d["size"].ToString().c_str(), nullptr, 10));
+							int priority = item.hasKey("priority") ? int(item["priority"].ToInt()) : 0;
+							total += dsize;
+							zpp::createPathForFile(dp.string());
+							dq.add(_servpath + HeapDeltas::folderName + "/" + name, dp.string(), false, nullptr,
+								[errorHandler](const std::string& err) {
+									errorHandler(err);
+								}, d[zip].ToString(), dsize, priority);
+						}
+						break;
+					}
+					if (deltaBase.count(key))continue;
+				}
+				/// the whole file is already downloaded for the other key
+				if (zhashes.count(hash) && !item.hasKey("chunks"))continue;
+				if (item.hasKey("chunks")) {
+					/// the installed version is split the same way as the uploader did it, only the chunks that are neither there nor in the heap are downloaded
+					zhashes[hash] = zhash;
+					localChunks[key];
+					chunkedKeys.push_back(key);
+					continue;
+				}
 				size_t fsize = 0;
 				if (item.hasKey("size"))fsize = item["size"].ToInt();
+				int priority = item.hasKey("priority") ? int(item["priority"].ToInt()) : 0;
 				total += fsize;
 				zhashes[hash] = zhash;
 				fname[hash] = key;
 				hashes.push_back(hash);
-				std::filesystem::path temp = temp_unique();
+				if (zhash.length() == 32 && fsize && item.hasKey("pack") && item.hasKey("offset")) {
+					/// the packed blobs are downloaded when all of them are known, the neighbours go by one request
+					packedBlobs[item["pack"].ToString()].push_back({ std::strtoull(item["offset"].ToString().c_str(), nullptr, 10), fsize, hash, zhash, priority,
+						item.hasKey("bundle") ? item["bundle"].ToString() : "" });
+					continue;
+				}
+				if (_directInstall && zhash.length() == 32 && uses[hash] == 1) {
+					/// the file is unzipped next to the destination file while it arrives, both hashes are verified on the fly
+					std::filesystem::path temp = _dest;
+					temp.append(key);
+					temp += extractingSuffix;
+					dq.addInflated(_servpath + hash.substr(0, 2) + "/" + hash, temp.string(), _keepHeap ? dst.string() : "",
+						[&inflatedLock, &inflated, key] {
+							std::scoped_lock lock(inflatedLock);
+							inflated.insert(key);
+						},
+						[errorHandler](const std::string& err) {
+							errorHandler(err);
+						}, zhash, hash, fsize, priority);
+					continue;
+				}
+				if (zhash.length() == 32) {
+					/// the queue verifies the zip hash while downloading and moves only the verified file to the heap
+					dq.add(_servpath + hash.substr(0, 2) + "/" + hash, dst.string(), false, nullptr,
+						[errorHandler](const std::string& err) {
+							errorHandler(err);
+						}, zhash, fsize, priority);
+					continue;
+				}
+				/// the old images have no zip hash, the content is checked after the download.
+				/// The name does not change between the runs, so the interrupted download is continued.
+				std::filesystem::path temp = _path(hash);
+				temp += ".unchecked";
 				zpp::createPathForFile(temp.string());
 				dq.add(_servpath + hash.substr(0, 2) + "/" + hash, temp.string(), false,
 					[this, temp, hash, zhash, errorHandler] {
@@ -202,13 +470,150 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 					},
 					[errorHandler](const std::string& err) {
 						errorHandler(err);
-					});
+					}, "", fsize, priority);
 			}
 		}
 	}
+	if (chunkedKeys.size()) {
+		/// the installed versions are split by the workers while the other files are downloaded, the keys are handled in order as their splits are done
+		struct splitJob {
+			std::string key;
+			uint64_t size = 0;
+			std::future<void> done;
+		};
+		std::vector<splitJob> splits;
+		uint64_t splitTotal = 0;
+		uint64_t splitDone = 0;
+		tasks::pool workers(_threads);
+		for (auto& key : chunkedKeys) {
+			splitJob& job = splits.emplace_back();
+			job.key = key;
+			if (!old.hasKey(key) || !old[key].hasKey(md5))continue;
+			std::filesystem::path installed = _dest;
+			installed.append(key);
+			std::error_code ec;
+			job.size = std::filesystem::file_size(installed, ec);
+			splitTotal += job.size;
+			size_t chunkSize = size_t(std::strtoull(image.at(key).at("chunkSize").ToString().c_str(), nullptr, 10));
+			std::map<std::string, uint64_t>* local = &localChunks[key];
+			job.done = workers.add([installed, chunkSize, local] {
+				uint64_t offset = 0;
+				HeapChunks::split(installed, chunkSize, [&](const void* data, size_t length) {
+					local->try_emplace(md5::hash(static_cast<const uint8_t*>(data), length), offset);
+					offset += length;
+					return true;
+				});
+			});
+		}
+		for (auto& job : splits) {
+			if (job.done.valid()) {
+				try {
+					job.done.get();
+				}
+				catch (std::exception&) {
+					/// the chunks of the file that can't be read are downloaded
+					localChunks[job.key].clear();
+				}
+				splitDone += job.size;
+				if (progress && !progress(size_t(splitDone), size_t(splitTotal), job.key, "Checking files") && !skipUserBreak) {
+					errorHandler("UserBreak");
+					userBreak = true;
+					workers.clear();
+					break;
+				}
+			}
+			const json::JSON& item = image.at(job.key);
+			const std::map<std::string, uint64_t>& local = localChunks[job.key];
+			int priority = item.hasKey("priority") ? int(item.at("priority").ToInt()) : 0;
+			for (auto c : item.at("chunks").ArrayRange()) {
+				std::string ch = c[md5].ToString();
+				if (ch.length() != 32 || local.count(ch) || queuedChunks.count(ch) || std::filesystem::exists(_path(ch)) || packs.find(ch, where))continue;
+				queuedChunks.insert(ch);
+				size_t csize = size_t(std::strtoull(c["size"].ToString().c_str(), nullptr, 10));
+				total += csize;
+				if (c.hasKey("pack") && c.hasKey("offset")) {
+					/// the chunk is the packed small file, it goes by the ranges of the pack with the other packed blobs
+					packedBlobs[c["pack"].ToString()].push_back({ std::strtoull(c["offset"].ToString().c_str(), nullptr, 10), csize, ch, c[zip].ToString(), priority, "" });
+					continue;
+				}
+				dq.add(_servpath + ch.substr(0, 2) + "/" + ch, _path(ch).string(), false, nullptr,
+					[errorHandler](const std::string& err) {
+						errorHandler(err);
+					}, c[zip].ToString(), csize, priority);
+			}
+		}
+	}
+	/// the bundle is downloaded whole if at least a half of it is needed, the gaps inside it are cheaper than the separate requests
+	std::map<std::string, std::pair<uint64_t, uint64_t>> bundleExtent;
+	std::map<std::string, uint64_t> bundleNeeds;
+	if (packedBlobs.size()) {
+		for (auto [key, item] : image.ObjectRange()) {
+			if (!item.hasKey("pack") || !item.hasKey("bundle") || !item.hasKey("offset") || !item.hasKey("size"))continue;
+			uint64_t offset = std::strtoull(item["offset"].ToString().c_str(), nullptr, 10);
+			uint64_t end = offset + uint64_t(item["size"].ToInt());
+			auto& extent = bundleExtent.try_emplace(item["pack"].ToString() + "/" + item["bundle"].ToString(), offset, end).first->second;
+			extent.first = std::min(extent.first, offset);
+			extent.second = std::max(extent.second, end);
+		}
+		for (auto& [pack, blobs] : packedBlobs) {
+			for (auto& b : blobs) {
+				if (b.bundle.length())bundleNeeds[pack + "/" + b.bundle] += b.length;
+			}
+		}
+	}
+	for (auto& [pack, blobs] : packedBlobs) {
+		std::sort(blobs.begin(), blobs.end(), [](const packedBlob& a, const packedBlob& b) { return a.offset < b.offset; });
+		auto wholeBundle = [&, &pack = pack](const packedBlob& b) {
+			if (b.bundle.empty())return false;
+			std::string id = pack + "/" + b.bundle;
+			auto e = bundleExtent.find(id);
+			return e != bundleExtent.end() && bundleNeeds[id] * 2 >= e->second.second - e->second.first;
+		};
+		/// the range goes on while the gap to the next blob is small or inside the bundle downloaded whole, the gaps are downloaded and skipped
+		for (size_t i = 0; i < blobs.size();) {
+			std::vector<downloader::queue::piece> pieces;
+			uint64_t begin = blobs[i].offset;
+			uint64_t end = begin;
+			int priority = blobs[i].priority;
+			for (; i < blobs.size(); i++) {
+				const packedBlob& b = blobs[i];
+				bool sameBundle = pieces.size() && b.bundle.length() && b.bundle == blobs[i - 1].bundle && wholeBundle(b);
+				if (pieces.size() && (b.offset < end || (b.offset - end > packGapMax && !sameBundle) || b.offset + b.length - begin > packRangeMax))break;
+				if (b.offset > end)pieces.push_back({ "", b.offset - end, "" });
+				zpp::createPathForFile(_path(b.hash).string());
+				pieces.push_back({ _path(b.hash).string(), b.length, b.zhash });
+				end = b.offset + b.length;
+				priority = std::max(priority, b.priority);
+			}
+			dq.addRange(_servpath + HeapPacks::folderName + "/" + pack + ".pack", begin, std::move(pieces), nullptr,
+				[errorHandler](const std::string& err) {
+					errorHandler(err);
+				}, priority);
+		}
+	}
 	dq.waitTheFinish();
+	if (log && needDownload) {
+		auto cs = dq.getConnectionStats();
+		std::cout << "Connections opened: " << cs.first << ", reused: " << cs.second << "\n";
+		auto rs = dq.getRetryStats();
+		std::cout << "Retries: " << rs.first << ", waited: " << rs.second << " ms\n";
+		std::cout << "Simultaneous downloads at the end: " << dq.getConcurrency() << "\n";
+		for (auto& ms : dq.getMirrorStats()) {
+			std::cout << "Mirror " << ms.base << " requests: " << ms.requests << ", failures: " << ms.failures << ", latency: " << ms.latency << " ms\n";
+		}
+	}
 	
-	if (err)return false;
+	if (err) {
+		/// the destination is not changed, so the files unzipped by the direct downloads are not needed
+		for (auto& key : inflated) {
+			std::filesystem::path temp = _dest;
+			temp.append(key);
+			temp += extractingSuffix;
+			std::error_code ec;
+			std::filesystem::remove(temp, ec);
+		}
+		return false;
+	}
 	/// now everything downloaded, ready to copy
 	total = 0;
 	cur = 0;
@@ -244,17 +649,50 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 			}
 			if (!exists) {
 				std::filesystem::path heapfile = _path(hash);
-				if (std::filesystem::exists(heapfile)) {
+				/// the direct download has already unzipped and verified the file
+				bool direct = inflated.count(key) > 0;
+				bool separate = !direct && std::filesystem::exists(heapfile);
+				bool packed = !direct && !separate && packs.find(hash, where);
+				bool patched = !direct && !separate && !packed && deltaBase.count(key) > 0;
+				bool chunked = !direct && !separate && !packed && !patched && item.hasKey("chunks");
+				if (direct || separate || packed || patched || chunked) {
 					std::filesystem::path p = _dest;
 					p.append(key);
 					try {
-						zpp::reader zw(heapfile.string());
-						zw.extractFirstToFile(p.string());
-						if(md5::file_hash(p.string()) != hash) {
-							errorHandler("Unable to replace the file <b>" + p.filename().string() + "</b>, probably program is run.");
-							anyFail = true;
-						} else {
-							anyCopy = true;
+						/// the file is hashed while extracted to the temporary name and replaces the destination only if the hash matches
+						std::filesystem::path temp = p;
+						temp += extractingSuffix;
+						bool extracted = direct;
+						if (!direct) {
+							md5::context digest;
+							auto onData = [&digest](const void* data, size_t length) {
+								digest.update(data, length);
+							};
+							if (separate) {
+								zpp::reader zw(heapfile.string());
+								extracted = zw.extractFirstToFile(temp.string(), onData);
+							}
+							else if (packed) extracted = packs.extract(hash, temp.string(), onData);
+							else if (patched) extracted = applyDelta(p, deltaBase[key], hash, temp.string(), onData);
+							else extracted = assembleChunks(item["chunks"], p, localChunks[key], temp.string(), onData);
+							extracted = extracted && digest.final() == hash;
+						}
+						std::error_code ec;
+						if (direct)inflated.erase(key);
+						if (!extracted) {
+							std::filesystem::remove(temp, ec);
+							errorHandler("DataAccessError");
+						}
+						else {
+							std::filesystem::rename(temp, p, ec);
+							if (ec) {
+								std::filesystem::remove(temp, ec);
+								errorHandler("Unable to replace the file <b>" + p.filename().string() + "</b>, probably program is run.");
+								anyFail = true;
+							}
+							else {
+								anyCopy = true;
+							}
 						}
 						if (item.hasKey("size")) {
 							cur += item["size"].ToInt();
@@ -270,6 +708,14 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 			}
 		}
 	}
+	/// the files unzipped by the direct downloads are not needed if the copying was stopped
+	for (auto& key : inflated) {
+		std::filesystem::path temp = _dest;
+		temp.append(key);
+		temp += extractingSuffix;
+		std::error_code ec;
+		std::filesystem::remove(temp, ec);
+	}
 	if (anyFail && anyCopy) {
 		errorHandler("Unable to replace any file in the destination folder <b>" + _dest.string() + "</b>, probably because of the lack of ADMIN privileges.");
 	}
@@ -282,7 +728,8 @@ bool fheap::FilesHeap::syncDestination(const json::JSON& image, bool remove_extr
 					if (item.hasKey("md5") == (i == 0)) {						
 						std::filesystem::path p = _dest;
 						p.append(key);
-						std::string m = "\n" + md5::file_hash(p.string()) + "\n";
+						/// the hash is taken from the scan, it is read from the cache for the unchanged files
+						std::string m = "\n" + (item.hasKey(md5) ? item[md5].ToString() : "") + "\n";
 						/// we delete only files that belong to the program's heap to prevent deleting user's files.
 						/// _hashesList contains all hashes present in the heap - all files that was someday in the program's image.
 						/// This prevents the potentially dangerous situation when the destination folder is incorrect and
@@ -318,7 +765,8 @@ int fheap::FilesHeap::uploadHeap(const std::string& bucket_name) {
 	res.exitstatus = 1;
 	if (_server.find("google") != std::string::npos) {
 		std::cout << "uploading " << _heapPath.generic_string() << " => gs://" << bucket_name << "/heap" << _heapPath.generic_string() << "\n";
-		std::string com = "gsutil -m rsync -d -r \"" + _heapPath.generic_string() + "\" \"gs://" + bucket_name + "/heap\"";
+		/// the list of the skipped deltas is local to the uploader
+		std::string com = "gsutil -m rsync -d -r -x \"^" + std::string(HeapDeltas::skippedName) + "$\" \"" + _heapPath.generic_string() + "\" \"gs://" + bucket_name + "/heap\"";
 		res = exec::Command::exec(com);
 		com = "gsutil setmeta -h \"cache-control:no-store\" \"gs://" + bucket_name + "/heap/Versions/root.json\"";
 		exec::Command::exec(com);
@@ -326,7 +774,7 @@ int fheap::FilesHeap::uploadHeap(const std::string& bucket_name) {
 	}
 	else if (_server.find("amazon") != std::string::npos) {
 		std::cout << "uploading " << _heapPath.generic_string() << " => gs://" << bucket_name << "/heap" << _heapPath.generic_string() << "\n";
-		std::string com = "aws s3 sync \"" + _heapPath.generic_string() + "\" s3://" + bucket_name + "/heap --acl=public-read";
+		std::string com = "aws s3 sync \"" + _heapPath.generic_string() + "\" s3://" + bucket_name + "/heap --acl=public-read --exclude " + HeapDeltas::skippedName;
 		res = exec::Command::exec(com);
 		std::cout << res.output << "\n" << "Uploading finished.\n\n";
 	}
@@ -341,7 +789,7 @@ int fheap::FilesHeap::downloadHeap(const std::string& bucket_name) {
 	if (_server.find("google") != std::string::npos) {
 		/// google buckets
 		std::cout << "downloading gs://" << bucket_name << "/heap => " << _heapPath.generic_string() << "\n";
-		std::string com = "gsutil -m rsync -d -r \"gs://" + bucket_name + "/heap\" \"" + _heapPath.generic_string() + "\"";
+		std::string com = "gsutil -m rsync -d -r -x \"^" + std::string(HeapDeltas::skippedName) + "$\" \"gs://" + bucket_name + "/heap\" \"" + _heapPath.generic_string() + "\"";
 		res = exec::Command::exec(com);
 		std::cout << res.output << "\n" << "Downloading finished.\n\n";
 	} else if (_server.find("amazon") != std::string::npos) {
@@ -356,154 +804,528 @@ int fheap::FilesHeap::downloadHeap(const std::string& bucket_name) {
 
 bool fheap::FilesHeap::createDestFolderImage(json::JSON& image, bool addToHeap, bool useCache, const std::vector<std::string>* exceptions) {
 	if (!valid())return false;
-	json::JSON cache;
+	ScanCache cache;
 	std::filesystem::path cp = _heapPath;
-	cp.append("cache.dat");
+	cp.append("cache.bin");
 	if (useCache) {
-		if (exists(cp)) {
-			jcc::readSafeJson(cache, cp.string());	
-		}
+		/// the JSON cache of the previous versions is converted once
+		std::filesystem::path jp = _heapPath;
+		jp.append("cache.dat");
+		cache.open(cp, jp);
 	}
-	if (cache.IsNull())cache = json::Object();
+	packs.open(_heapPath);
+	chunks.open(_heapPath);
+	/// the records for the new cache, it is rewritten only if something changed
+	std::vector<std::pair<std::string, cacheRecord>> cached;
+	bool cacheChanged = false;
+	std::string stage = addToHeap ? "Updating the heap" : "Checking files";
 	try {
-		auto ftime = [](const std::filesystem::path& path)-> std::string {
-			return std::to_string(
-				std::chrono::duration_cast<std::chrono::seconds>(
-					std::filesystem::last_write_time(path).time_since_epoch()).count());
-		};
 		size_t total = 0;
 		size_t cur = 0;
 		const std::string md5 = "md5";
 		const std::string zip = "zip";
-		std::vector<std::filesystem::directory_entry> files;
-		for (auto& p : std::filesystem::recursive_directory_iterator(_dest)) {
-			bool add = true;
-			if(exceptions) {
-				std::filesystem::path rel = std::filesystem::relative(p, _dest);
-				for (int i = 0; i < exceptions->size(); i++) {
-					if(jcc::wild_match(rel.string(), exceptions->at(i))) {
-						add = false;
-						break;
+		struct scanItem {
+			std::filesystem::path path;
+			std::string rel;
+			std::string time;
+			std::string hash;
+			std::string zhash;
+			int64_t mtime = 0;
+			int64_t ctime = 0;
+			uint64_t inode = 0;
+			size_t size = 0;
+			size_t zsize = 0;
+			/// the pack with the blob, empty if the blob is the separate file
+			std::string pack;
+			uint64_t offset = 0;
+			uint32_t bundle = 0;
+			/// the new small blob, it is packed when the scan ends
+			std::filesystem::path unpacked;
+			/// the chunks of the big file
+			std::vector<HeapChunks::chunk> chunkList;
+			size_t chunkSize = 0;
+			size_t weight = 0;
+			bool folder = false;
+			bool inCache = false;
+			cacheRecord record;
+			std::future<void> done;
+		};
+		/// the traversal, hashing and merging work as the pipeline: the scanner workers look up the cache and pass the files to the hashing workers
+		/// as soon as they are found, this thread merges the results into the image in the order the files were found.
+		/// The files with the same content should be compressed to the heap only once, the first worker that meets the hash does it.
+		std::deque<scanItem> items;
+		std::mutex itemsLock;
+		std::condition_variable itemsReady;
+		bool walked = false;
+		std::mutex claimsLock;
+		std::map<std::string, std::shared_future<std::string>> claims;
+		/// the size of the blob and its place in the pack
+		auto locate = [this](scanItem& it) {
+			std::error_code ec;
+			size_t zsize = std::filesystem::file_size(_path(it.hash), ec);
+			HeapPacks::location where;
+			if (!ec)it.zsize = zsize;
+			else if (packs.find(it.hash, where)) {
+				it.zsize = size_t(where.length);
+				it.pack = where.pack;
+				it.offset = where.offset;
+				it.bundle = where.bundle;
+			}
+		};
+		/// the big file is split to the chunks, the file that was split before is not read again
+		auto chunkJob = [this](scanItem& it) {
+			HeapPacks::location where;
+			if (it.hash.length() == 32) {
+				if (exists(_path(it.hash)) || packs.find(it.hash, where))return false;
+				if (!chunks.find(it.hash, it.chunkSize, it.chunkList)) {
+					it.chunkList.clear();
+					it.hash.clear();
+				}
+			}
+			if (it.chunkList.empty()) {
+				std::string hash;
+				auto inPack = [this](HeapChunks::chunk& c) {
+					HeapPacks::location where;
+					if (!packs.find(c.hash, where))return false;
+					c.zhash = where.zip;
+					c.size = where.length;
+					return true;
+				};
+				if (!chunks.add(it.path, _chunkSize, [this](const std::string& h) { return _path(h); }, inPack, blobEntryName, hash, it.chunkList)) {
+					it.chunkList.clear();
+					return false;
+				}
+				it.hash = hash;
+				it.chunkSize = _chunkSize;
+			}
+			it.zhash.clear();
+			it.zsize = 0;
+			for (auto& c : it.chunkList) it.zsize += size_t(c.size);
+			return true;
+		};
+		auto describe = [this](const scanItem& it, json::JSON& itm) {
+			if (it.zsize)itm["size"] = std::to_string(it.zsize);
+			if (it.chunkList.size()) {
+				itm["chunkSize"] = std::to_string(it.chunkSize);
+				json::JSON list = json::Array();
+				for (auto& c : it.chunkList) {
+					json::JSON e = json::Object();
+					e["md5"] = c.hash;
+					e["zip"] = c.zhash;
+					e["size"] = std::to_string(c.size);
+					e["length"] = std::to_string(c.length);
+					/// the chunk that is the packed small file is downloaded from the pack, it has no separate file
+					HeapPacks::location where;
+					if (packs.find(c.hash, where) && !std::filesystem::exists(_path(c.hash))) {
+						e["pack"] = where.pack;
+						e["offset"] = std::to_string(where.offset);
 					}
+					list.append(e);
 				}
+				itm["chunks"] = list;
 			}
-			if (add) {
-				files.push_back(p);
-				total += 1000;
+			if (it.pack.length()) {
+				itm["pack"] = it.pack;
+				itm["offset"] = std::to_string(it.offset);
+				itm["bundle"] = std::to_string(it.bundle);
 			}
-		}
-		std::map<std::string, bool> handled;
-		std::map< std::string, size_t> countedAs;
-		for (int i = 0; i < 2; i++) {
-			handled.clear();
-			int k = 0;
-			for (auto& p : files) {
-				size_t total0 = total;
-				if(i)cur += 1000;
-				if (progress && !progress(cur, total, p.path().string(), addToHeap ? "Updating the heap" : "Checking files")) {
-					image = json::Object();
-					return false;
+		};
+		auto hashJob = [this, addToHeap, &claimsLock, &claims, &locate, &chunkJob](scanItem& it) {
+			if (addToHeap && _chunkFiles && it.size >= _chunkFiles && chunkJob(it))return;
+			/// the content that is not in the heap yet is read once: it is hashed and compressed at the same time, the archive is hashed while written
+			std::filesystem::path packed;
+			HeapPacks::location where;
+			if (addToHeap && (it.hash.length() != 32 || (!exists(_path(it.hash)) && !packs.find(it.hash, where)))) {
+				md5::context source;
+				md5::context archive;
+				packed = temp_unique();
+				if (zpp::packFile(it.path.string(), packed.string(), blobEntryName,
+					[&source](const void* data, size_t length) { source.update(data, length); },
+					[&archive](const void* data, size_t length) { archive.update(data, length); })) {
+					it.hash = source.final();
+					it.zhash = archive.final();
 				}
-				if (p.is_regular_file()) {
-					size_t filesize = file_size(p.path());
-					bool already = false;
-
-					// easiest check for file repeat - if size and name are same. But later check will be more careful - by md5
-					// this is just to correct progress bar
-					std::string s = std::to_string(filesize) + p.path().filename().string();
-					if(handled.count(s))already = true;
-					else handled[s] = true;
-					
-					std::string hash;
-					std::string zhash;
-					std::string time = ftime(p);
-					std::string rel = relative(p, _dest).string();
-					bool hashFromCache = false;
-					if (useCache && cache.hasKey(rel)) {
-						json::JSON& itm = cache[rel];
-						if (itm.hasKey("time") && itm["time"].ToString() == time) {
-							if (itm.hasKey(md5)) {
-								hash = itm[md5].ToString();
-								hashFromCache = true;
-							}
-							if (itm.hasKey(zip)) {
-								zhash = itm[zip].ToString();
-								if (zhash.length() != 32)zhash.clear();
-							}
+				else {
+					std::error_code ec;
+					std::filesystem::remove(packed, ec);
+					packed.clear();
+					it.hash.clear();
+					it.zhash.clear();
+				}
+			}
+			if (it.hash.length() != 32) {
+				it.hash = md5::file_hash(it.path.string());
+				/// the image without the file would remove it on the clients, the unreadable file fails the whole image
+				if (it.hash.length() != 32)throw std::runtime_error("Unable to read the file");
+			}
+			if (it.hash.length() == 32) {
+				std::filesystem::path zp = _path(it.hash);
+				if (addToHeap) {
+					/// the same content may be met several times, only the first worker puts it to the heap
+					std::promise<std::string> own;
+					std::shared_future<std::string> claim;
+					bool first = false;
+					{
+						std::scoped_lock lock(claimsLock);
+						auto c = claims.find(it.hash);
+						if (c == claims.end()) {
+							claim = claims[it.hash] = own.get_future().share();
+							first = true;
 						}
+						else claim = c->second;
 					}
-					json::JSON& itm = image[rel];
-					if(itm.IsNull()) itm = json::Object();
-					if (hash.size() != 32) {
-						if (itm.hasKey(md5))hash = itm[md5].ToString();
-						else {							
-							size_t fsize = filesize / 10 + 1;;
-							if (i == 0) {
-								total += fsize;
-							}else{
-								hash = md5::file_hash(p.path().string());
+					if (first) {
+						try {
+							std::error_code ec;
+							if (!packed.empty() && !exists(zp) && !packs.find(it.hash, where)) {
+								/// the small blobs are packed when the scan ends in the order of the paths, so the files of the same folder are the neighbours
+								if (_packBlobs && std::filesystem::file_size(packed, ec) <= _packBlobs && !ec) {
+									it.unpacked = packed;
+								}
+								else {
+									zpp::createPathForFile(zp.string());
+									std::filesystem::rename(packed, zp);
+								}
+								packed.clear();
+							}
+							else if (!packed.empty() || it.zhash.length() != 32) {
+								if (!exists(zp) && packs.find(it.hash, where))it.zhash = where.zip;
+								else it.zhash = md5::file_hash(zp.string());
 							}
+							own.set_value(it.zhash);
+						}
+						catch (...) {
+							own.set_exception(std::current_exception());
+							throw;
 						}
 					}
-					if (hash.length() == 32 || i == 0) {
-						std::filesystem::path zp = _path(hash);
-						if (addToHeap) {
-							bool exzp = exists(zp);
-							if ((i == 0 && hash.empty()) || !exzp) {
-								zhash.clear();
-								if (i == 0) {
-									if (!already) {
-										total += filesize;
-									}
-								}
-								else {									
-									zpp::writer zw(zp.string());
-									zw.addFile(p.path().string(), hash);
-									zhash = md5::file_hash(zp.string());
-								}								
-							}							
-							if (zhash.length() != 32 && (i == 0 || exists(zp))) {
-								size_t fsize = filesize / 30 + 1;
-								if (i == 0) total += fsize;								
-								else zhash = md5::file_hash(zp.string());									
-							}
+					else {
+						it.zhash = claim.get();
+					}
+				}
+				locate(it);
+			}
+			if (!packed.empty()) {
+				std::error_code ec;
+				std::filesystem::remove(packed, ec);
+			}
+		};
+		tasks::pool workers(_threads);
+		/// the exceptions are compiled once, the scanner keeps the matching state of each folder for its children,
+		/// folders where everything matches the exceptions are not descended at all
+		jcc::wild_matcher skip(exceptions ? *exceptions : std::vector<std::string>());
+		FolderScanner scanner;
+		/// the image that fails leaves no new small blobs in the heap, the running jobs finish first, the rest are dropped
+		auto abandon = [&] {
+			scanner.stop();
+			workers.clear();
+			for (auto& it : items) {
+				if (it.done.valid())it.done.wait();
+				std::error_code ec;
+				if (!it.unpacked.empty())std::filesystem::remove(it.unpacked, ec);
+			}
+			image = json::Object();
+		};
+		scanner.start(_dest, _threads, &skip, [&](folderEntry& e) {
+			scanItem it;
+			it.path = std::move(e.path);
+			it.rel = std::move(e.rel);
+			it.mtime = e.mtime;
+			it.time = std::to_string(e.mtime / 1000000000);
+			it.folder = e.folder;
+			it.size = e.size;
+			it.inode = e.inode;
+			it.ctime = e.ctime;
+			/// the amount of work is estimated by the sizes without touching the files content
+			it.weight = 1000;
+			if (!it.folder) {
+				if (useCache && cache.find(it.rel, it.record)) {
+					it.inCache = true;
+					/// the cached hashes are trusted only if it is the same file (inode) of the same size,
+					/// and it was neither modified nor changed in any other way (ctime) since the previous scan
+					const cacheRecord& r = it.record;
+					/// the legacy record knows only the size and the seconds of the modification time, it is upgraded to the full key after this scan
+					bool same = r.size == it.size && ((r.flags & cacheRecord::legacy) ? r.mtime / 1000000000 == it.mtime / 1000000000 :
+						r.mtime == it.mtime && r.inode == it.inode && r.ctime == it.ctime);
+					if (same) {
+						if (it.record.flags & cacheRecord::hasMd5) {
+							it.hash = ScanCache::hex(it.record.md5);
+						}
+						if (it.record.flags & cacheRecord::hasZip) {
+							it.zhash = ScanCache::hex(it.record.zip);
 						}
-						if (zhash.length() == 32)itm[zip] = zhash;
-						if (hash.length() == 32)itm[md5] = hash;
-						itm["time"] = time;
-						if (exists(zp))itm["size"] = std::to_string(std::filesystem::file_size(zp));
 					}
 				}
-				else if (p.is_directory()) {
-					std::string rel = relative(p, _dest).string();
-					json::JSON& itm = image[rel] = json::Object();
-					itm["folder"] = true;
-					itm["time"] = ftime(p);
+				if (it.hash.length() != 32) {
+					it.hash.clear();
+					it.weight += it.size / 10 + 1;
+					if (addToHeap) {
+						/// most probably the new content, it will be compressed
+						it.weight += it.size;
+					}
 				}
-				if(i == 0) {
-					countedAs[p.path().string()] = total - total0;
-				} else {
-					cur += countedAs[p.path().string()];
-					if (progress) {
-						if (!progress(cur, total, p.path().string(), "Estimation")) {
-							image = json::Object();
-							return false;
+				if (addToHeap && it.zhash.empty()) {
+					it.weight += it.size / 30 + 1;
+				}
+			}
+			{
+				std::scoped_lock lock(itemsLock);
+				scanItem& added = items.emplace_back(std::move(it));
+				total += added.weight;
+				if (!added.folder) {
+					added.done = workers.add([&hashJob, &added] { hashJob(added); });
+				}
+			}
+			itemsReady.notify_one();
+		}, [&] {
+			{
+				std::scoped_lock lock(itemsLock);
+				walked = true;
+			}
+			itemsReady.notify_one();
+		});
+		for (size_t next = 0;; next++) {
+			scanItem* pit;
+			size_t known;
+			{
+				std::unique_lock lock(itemsLock);
+				itemsReady.wait(lock, [&] { return next < items.size() || walked; });
+				if (next == items.size())break;
+				pit = &items[next];
+				/// the total grows while the traversal goes on
+				known = total;
+			}
+			scanItem& it = *pit;
+			if (progress && !progress(cur, known, it.path.string(), stage)) {
+				abandon();
+				return false;
+			}
+			if (it.folder) {
+				json::JSON& itm = image[it.rel] = json::Object();
+				itm["folder"] = true;
+				itm["time"] = it.time;
+			}
+			else {
+				try {
+					it.done.get();
+				}
+				catch (std::exception& e) {
+					/// the image without the file would remove it on the clients, so the whole image fails
+					if (errors) errors(stage, it.path.string() + ": " + e.what());
+					abandon();
+					return false;
+				}
+				json::JSON& itm = image[it.rel];
+				if (itm.IsNull()) itm = json::Object();
+				if (it.hash.length() == 32) {
+					if (it.zhash.length() == 32)itm[zip] = it.zhash;
+					itm[md5] = it.hash;
+					itm["time"] = it.time;
+					describe(it, itm);
+					if (useCache) {
+						cacheRecord r;
+						memset(&r, 0, sizeof(r));
+						r.flags = cacheRecord::hasMd5;
+						ScanCache::unhex(it.hash, r.md5);
+						if (ScanCache::unhex(it.zhash, r.zip))r.flags |= cacheRecord::hasZip;
+						r.size = it.size;
+						r.mtime = it.mtime;
+						r.ctime = it.ctime;
+						r.inode = it.inode;
+						r.zipSize = it.zsize;
+						if (it.inCache) {
+							r.pathOffset = it.record.pathOffset;
+							r.pathLength = it.record.pathLength;
 						}
+						if (!it.inCache || memcmp(&r, &it.record, sizeof(r)) != 0)cacheChanged = true;
+						cached.emplace_back(it.rel, r);
 					}
 				}
 			}
-			if (total == 0)break;
+			cur += it.weight;
+		}
+		/// the destination that is not created yet is empty, but the image without an unreadable folder would remove its files on the clients
+		if (scanner.lastError().length() && std::filesystem::exists(_dest)) {
+			if (log) std::cout << scanner.lastError() << "\n";
+			if (errors) errors(stage, scanner.lastError());
+			abandon();
+			return false;
+		}
+		/// the neighbour files of the same folder form the bundle, the client downloads the bundle by one request if it needs most of it
+		std::vector<scanItem*> unpacked;
+		for (auto& it : items) {
+			if (!it.unpacked.empty())unpacked.push_back(&it);
+		}
+		std::sort(unpacked.begin(), unpacked.end(), [](const scanItem* a, const scanItem* b) { return a->rel < b->rel; });
+		std::filesystem::path folder;
+		uint64_t bundleBytes = 0;
+		for (scanItem* it : unpacked) {
+			std::error_code ec;
+			uint64_t length = std::filesystem::file_size(it->unpacked, ec);
+			std::filesystem::path parent = std::filesystem::path(it->rel).parent_path();
+			if (parent != folder || bundleBytes + length > _bundleSize) {
+				packs.startBundle();
+				folder = parent;
+				bundleBytes = 0;
+			}
+			bundleBytes += length;
+			HeapPacks::location where;
+			if (!packs.append(it->hash, it->zhash, it->unpacked, where)) {
+				/// the blob stays the separate file
+				std::filesystem::path zp = _path(it->hash);
+				zpp::createPathForFile(zp.string());
+				std::filesystem::rename(it->unpacked, zp, ec);
+			}
+			std::filesystem::remove(it->unpacked, ec);
+		}
+		/// the packed blobs of the image are available only after the index of the pack is written
+		if (!packs.finish()) {
+			if (errors) errors(stage, "Unable to write the pack index");
+			abandon();
+			return false;
+		}
+		/// the items of the blobs packed just now, the same content may be used by several files
+		for (auto& it : items) {
+			if (it.folder || it.hash.length() != 32 || it.zsize)continue;
+			locate(it);
+			describe(it, image[it.rel]);
+		}
+		if (progress && !progress(cur, total, "", stage)) {
+			image = json::Object();
+			return false;
 		}
 	}
 	catch (std::filesystem::filesystem_error& e) {
 		if (log) std::cout << e.what();
+		if (errors) errors(stage, e.what());
+		/// the partial image and the cache of it are not kept
+		image = json::Object();
+		return false;
 	}
-	if (useCache) {
-		jcc::writeSafeJson(image, cp.string());
+	if (useCache && (cacheChanged || cached.size() != cache.size())) {
+		cache.close();
+		ScanCache::write(cp, cached);
 	}
 	return true;
 }
 
+void fheap::FilesHeap::createDeltas(json::JSON& image, const std::vector<json::JSON>& previous, size_t maxFileSize) {
+	if (!valid())return;
+	packs.open(_heapPath);
+	const std::string md5 = "md5";
+	const std::string stage = "Creating deltas";
+	struct deltaJob {
+		std::string key;
+		std::string hash;
+		uint64_t zsize = 0;
+		/// the md5 of the previous versions of the file
+		std::vector<std::string> bases;
+		json::JSON deltas = json::Array();
+		/// the deltas made now and found too big
+		std::vector<std::string> skipped;
+		std::future<void> done;
+	};
+	/// the deltas that were too big in the previous runs
+	std::filesystem::path sp = _heapPath;
+	sp.append(HeapDeltas::skippedName);
+	std::set<std::string> skipped;
+	{
+		std::ifstream f(sp);
+		std::string line;
+		while (std::getline(f, line)) if (line.length())skipped.insert(line);
+	}
+	std::deque<deltaJob> jobs;
+	for (auto& [key, item] : image.ObjectRange()) {
+		if (!item.hasKey(md5) || item.hasKey("chunks") || !item.hasKey("size"))continue;
+		deltaJob job;
+		job.key = key;
+		job.hash = item[md5].ToString();
+		job.zsize = std::strtoull(item["size"].ToString().c_str(), nullptr, 10);
+		for (auto& prev : previous) {
+			if (!prev.hasKey(key))continue;
+			const json::JSON& pi = prev.at(key);
+			if (!pi.hasKey(md5) || pi.hasKey("chunks"))continue;
+			std::string base = pi.at(md5).ToString();
+			if (base.length() == 32 && base != job.hash && std::find(job.bases.begin(), job.bases.end(), base) == job.bases.end()) {
+				job.bases.push_back(base);
+			}
+		}
+		if (job.bases.size())jobs.push_back(std::move(job));
+	}
+	auto deltaWork = [this, maxFileSize, &skipped](deltaJob& job) {
+		std::filesystem::path file = _dest;
+		file.append(job.key);
+		std::error_code ec;
+		uint64_t fsize = std::filesystem::file_size(file, ec);
+		if (ec || fsize > maxFileSize)return;
+		/// the file is read only if some delta is made now
+		std::string target;
+		bool loaded = false;
+		for (auto& base : job.bases) {
+			/// the delta made by the previous runs is kept in the heap, the one that was too big is listed
+			std::string name = HeapDeltas::blobName(base, job.hash);
+			if (skipped.count(name))continue;
+			std::filesystem::path dp = _deltaPath(base, job.hash);
+			if (!std::filesystem::exists(dp, ec)) {
+				if (!loaded) {
+					target.resize(size_t(fsize));
+					std::ifstream f(file, std::ios::binary);
+					if (!f.read(&target[0], std::streamsize(fsize)))return;
+					loaded = true;
+				}
+				std::string content;
+				if (!readBlob(base, content) || content.size() > maxFileSize)continue;
+				std::string delta = HeapDeltas::diff(content, target);
+				std::filesystem::path temp = temp_unique();
+				if (!zpp::packData(delta.data(), delta.size(), temp.string(), blobEntryName)) {
+					std::filesystem::remove(temp, ec);
+					continue;
+				}
+				zpp::createPathForFile(dp.string());
+				std::filesystem::rename(temp, dp, ec);
+				if (ec) {
+					std::filesystem::remove(temp, ec);
+					continue;
+				}
+			}
+			/// the small gain is not worth the second request
+			uint64_t dsize = std::filesystem::file_size(dp, ec);
+			if (ec)continue;
+			if (dsize * 4 > job.zsize * 3) {
+				std::filesystem::remove(dp, ec);
+				job.skipped.push_back(name);
+				continue;
+			}
+			json::JSON d = json::Object();
+			d["base"] = base;
+			d["zip"] = md5::file_hash(dp.string());
+			d["size"] = std::to_string(dsize);
+			job.deltas.append(d);
+		}
+	};
+	tasks::pool workers(_threads);
+	for (auto& job : jobs) job.done = workers.add([&deltaWork, &job] { deltaWork(job); });
+	size_t cur = 0;
+	std::vector<std::string> rejected;
+	for (auto& job : jobs) {
+		if (progress)progress(cur++, jobs.size(), job.key, stage);
+		try {
+			job.done.get();
+			if (job.deltas.size())image[job.key]["deltas"] = job.deltas;
+		}
+		catch (std::exception& e) {
+			/// the file goes without the deltas, the clients download it whole
+			if (log) std::cout << "Unable to make the deltas of " << job.key << ": " << e.what() << "\n";
+		}
+		rejected.insert(rejected.end(), job.skipped.begin(), job.skipped.end());
+	}
+	if (rejected.size()) {
+		std::ofstream f(sp, std::ios::app);
+		for (auto& name : rejected) f << name << "\n";
+		if (!f && log) std::cout << "Unable to write " << sp.string() << "\n";
+	}
+}
+
 bool fheap::FilesHeap::valid() {
 	return _heapPath.string().length() > 6 && _dest.string().length() > 6;
 }
@@ -5,13 +5,19 @@
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 
+#include <atomic>
 #include <filesystem>
 #include <functional>
 #include <thread>
 
 #include "json.h"
 #include "md5.h"
+#include "ScanCache.h"
+#include "HeapPacks.h"
+#include "HeapChunks.h"
+#include "HeapDeltas.h"
 #include "httplib.h"
+#include "download.h"
 #include "zpp.h"
 
 namespace fheap {	
@@ -26,6 +32,40 @@ namespace fheap {
 		std::string _servpath;
 		std::string _hashesList;
 		bool log;
+		size_t _threads;
+		size_t _segmentSize;
+		size_t _minConnections;
+		size_t _maxConnections;
+		downloader::queue::policy _downloadOrder;
+		/// shared by all the downloads of the heap, so the limit is global
+		downloader::rate_limiter limiter;
+		/// the other heap URLs with the same content as _servpath
+		std::vector<std::string> _mirrors;
+		size_t _raceBytes;
+		/// the files are unzipped while downloaded, the heap copy is kept if _keepHeap
+		bool _directInstall;
+		bool _keepHeap;
+		/// the packed blobs of the heap, the blobs up to _packBlobs bytes are packed when the heap is updated
+		HeapPacks packs;
+		size_t _packBlobs;
+		/// the biggest bundle of the neighbour packed blobs
+		size_t _bundleSize;
+		/// the files from _chunkFiles bytes are split to the chunks of _chunkSize bytes in average when the heap is updated
+		HeapChunks chunks;
+		size_t _chunkFiles;
+		size_t _chunkSize;
+		/// write the file made of the chunks, the chunk is taken from the installed file if it is there, otherwise from the heap
+		bool assembleChunks(const json::JSON& list, const std::filesystem::path& installed, const std::map<std::string, uint64_t>& local,
+			const std::string& destFilename, const zpp::data_callback& onData);
+		/// the heap file of the delta
+		std::filesystem::path _deltaPath(const std::string& base, const std::string& hash);
+		/// write the file patching the installed version with the delta from the heap
+		bool applyDelta(const std::filesystem::path& installed, const std::string& base, const std::string& hash,
+			const std::string& destFilename, const zpp::data_callback& onData);
+		/// read the content of the separate or the packed blob, returns false if there is no such blob or it is broken
+		bool readBlob(const std::string& hash, std::string& content);
+		/// let the queue download the heap files from _servpath or the mirrors
+		void useMirrors(downloader::queue& q);
 		progressFn progress;
 		errorsFn errors;
 		std::filesystem::path temp_unique();
@@ -58,6 +98,21 @@ namespace fheap {
 		 */
 		void setErrors(errorsFn fn);
 
+		/// Set the amount of threads used to hash and compress the files, 0 (default) means the number of the CPU cores.
+		void setThreads(size_t threads);
+
+		/// Set the size of the segment, the bigger files are downloaded by several connections at once, 0 means the single connection. The default is 32 MB.
+		void setSegmentSize(size_t size);
+
+		/// Set the bounds of the simultaneous downloads, the amount is adapted to the measured throughput and the failures. The default is 2..32.
+		void setConnections(size_t min, size_t max);
+
+		/// Set the order of the downloads of the same priority (the \b "priority" of the image item), the default is the largest files first.
+		void setDownloadOrder(downloader::queue::policy order);
+
+		/// Limit the overall download rate, bytes per second, 0 (default) means no limit. May be changed while the downloads go on.
+		void setRateLimit(size_t bytes_per_second);
+
 		/// Set to the write-accessible folder to place the downloaded files.
 		void setHeapPlacement(const std::filesystem::path& path);
 
@@ -72,11 +127,48 @@ namespace fheap {
 		* Each file should be zipped and named as the original file md5, without the zip extension.
 		*/
 		void setServer(const std::string& server, const std::string& initialPath);
+
+		/** Set the mirrors of the heap. The downloads use the heap URL of the \b setServer and the mirrors in the order of the preference,
+		* the failed download is retried on the next mirror.
+		* \param mirrors the full heap URLs of the mirrors, like \b "https://mirror.example.com/bucket-name/heap/"
+		* \param raceBytes if not 0, the first file of every download session is requested from all the mirrors and the mirror that
+		* gives so many bytes first is preferred in that session.
+		*/
+		void setMirrors(const std::vector<std::string>& mirrors, size_t raceBytes = 0);
+
+		/** Unzip the downloaded files while they arrive, so the new files are ready to replace the destination files when the download ends,
+		* there is no separate unzipping pass. The destination files are replaced only after all the downloads succeed, like without this mode.
+		* Works for the images that have the \b "zip" hashes, the older images are downloaded to the heap first.
+		* \param direct enable the mode, it is disabled by default
+		* \param keepHeap write the downloaded archives to the heap too, so they are available for the later installs and the undo.
+		* If false, the heap gets nothing from the direct downloads.
+		*/
+		void setDirectInstall(bool direct, bool keepHeap = true);
+
+		/** Put the small blobs to the packs when the heap is updated by \b createDestFolderImage, instead of the separate file for each blob.
+		* The image items of the packed blobs get the \b "pack" and the \b "offset", the clients download the neighbour packed blobs
+		* by one Range request. The clients that don't know the packs can't use such images, so it is disabled by default.
+		* The new blobs of the same folder are packed one after another and form the \b "bundle", the client downloads the whole bundle
+		* by one request when it needs at least a half of it.
+		* \param maxBlobSize the biggest blob to pack, bytes, 0 disables the packing. The bigger blobs stay separate files.
+		* \param bundleSize the biggest bundle, bytes
+		*/
+		void setPackedBlobs(size_t maxBlobSize, size_t bundleSize = 1024 * 1024);
+
+		/** Split the big files to the chunks by the content when the heap is updated by \b createDestFolderImage, the chunks are stored as the blobs.
+		* The image items of such files get the \b "chunks" list instead of the \b "zip", so the client downloads only the chunks that changed,
+		* the rest is taken from the heap or from the installed version of the file. The clients that don't know the chunks can't use
+		* such images, so it is disabled by default. The files that are already in the heap as the whole blobs are not split.
+		* \param minFileSize the smallest file to split, bytes, 0 disables the chunking
+		* \param averageChunk the average chunk size, bytes
+		*/
+		void setChunking(size_t minFileSize, size_t averageChunk = 1024 * 1024);
 		
 		/** Places the list of files in the destination folder to the JSON image, creates files heap if necessary.
 		* \param image the image to be created
 		* \param addToHeap add all files from the destination folder to the files heap
-		* \param useCache use the cacche from the previous runs. Cache usage speeds up the process a lot.
+		* \param useCache use the cacche from the previous runs. Cache usage speeds up the process a lot. The cached hashes are used only if
+		* the file has the same size, the same inode (file id), the same modification and change times, so the cache is safe to use by default.
 		* \param exceptions optional pointer to the array of exceptions wildcards.
 		* The image consists of similar JSON records (example):
 		* \code 		
@@ -85,7 +177,18 @@ namespace fheap {
 		*		"md5" : "ba9f1685923ea3e024fb1115ab785574", // md5 of the original file
 		*		"size" : "530", // ziped size
 		*		"time" : "13199696093", // modification time
-		*		"zip" : "b0b2c09099d4448d8277ef3647e5325b" // md5 of the zip file
+		*		"zip" : "b0b2c09099d4448d8277ef3647e5325b", // md5 of the zip file
+		*		"pack" : "1697031234567890_1", // optional, the pack with the zip file
+		*		"offset" : "4096", // the position of the zip file in the pack
+		*		"bundle" : "3" // the bundle of the neighbour blobs in the pack
+		*	}
+		*	// the big file split to the chunks, every chunk is the separate blob:
+		*	"Data\\resources.bin" : {
+		*		"md5" : "5d41402abc4b2a76b9719d911017c592",
+		*		"size" : "734003200", // the sum of the chunk blob sizes
+		*		"time" : "13199696093",
+		*		"chunkSize" : "1048576", // the average chunk size the file was split with
+		*		"chunks" : [ { "md5" : "...", "zip" : "...", "size" : "530112", "length" : "1048012" }, ... ]
 		*	}
 		*	// folders:
 		*	"UserPrefs\\Alphas" : { // folder name
@@ -94,7 +197,17 @@ namespace fheap {
 		*	}
 		* \endcode
 		*/
-		bool createDestFolderImage(json::JSON& image, bool addToHeap, bool useCache, const std::vector<std::string>* exceptions = nullptr);
+		bool createDestFolderImage(json::JSON& image, bool addToHeap, bool useCache = true, const std::vector<std::string>* exceptions = nullptr);
+
+		/** Add the binary deltas from the previous versions of the same files to the image made by \b createDestFolderImage, the deltas are put to the heap.
+		* The client that has the base version installed downloads the delta instead of the whole file and checks the patched file by the md5.
+		* The item gets the list like \code "deltas" : [ { "base" : "<md5 of the previous version>", "zip" : "<md5 of the delta blob>", "size" : "1200" } ] \endcode
+		* The delta is listed only if it is notably smaller than the blob of the file. The chunked files and the bases that are not in the heap are skipped.
+		* \param image the new image, the files are read from the destination folder
+		* \param previous the images of the previous versions
+		* \param maxFileSize the biggest file to make the deltas for, both versions are kept in the memory
+		*/
+		void createDeltas(json::JSON& image, const std::vector<json::JSON>& previous, size_t maxFileSize = 16 * 1024 * 1024);
 
 		/// returns true if the passed folders are valid and write-accessible.
 		bool valid();
@@ -0,0 +1,239 @@
+#include "HeapFilesSync.h"
+#include "HeapPacks.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace fheap {
+	struct packIndexHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint64_t count;
+	};
+	static const char packMagic[8] = { 'A', 'U', 'P', 'A', 'C', 'K', 'I', 'X' };
+	static const uint32_t packVersion = 2;
+	/// the blob is copied to the pack and read from the pack by the pieces of this size
+	static const size_t packBufferSize = 1 << 18;
+}
+
+const char* fheap::HeapPacks::folderName = "Packs";
+
+fheap::HeapPacks::HeapPacks() {
+	written = 0;
+	bundle = 0;
+	nextBundle = false;
+	_maxPackSize = uint64_t(512) * 1024 * 1024;
+}
+
+fheap::HeapPacks::~HeapPacks() {
+	finish();
+}
+
+bool fheap::HeapPacks::open(const std::filesystem::path& heapPath) {
+	std::scoped_lock guard(lock);
+	finishPack();
+	folder = heapPath;
+	folder.append(folderName);
+	names.clear();
+	entries.clear();
+	added.clear();
+	std::error_code ec;
+	for (auto& p : std::filesystem::directory_iterator(folder, ec)) {
+		if (p.path().extension() != ".idx")continue;
+		std::ifstream f(p.path(), std::ios::binary);
+		packIndexHeader h;
+		if (!f.read(reinterpret_cast<char*>(&h), sizeof(h)))continue;
+		if (memcmp(h.magic, packMagic, sizeof(packMagic)) != 0 || h.version != packVersion || h.recordSize != sizeof(packRecord))continue;
+		/// the index is written after the pack, so the pack should hold all the blobs of the index
+		std::filesystem::path pack = p.path();
+		pack.replace_extension(".pack");
+		uint64_t packSize = std::filesystem::file_size(pack, ec);
+		if (ec)continue;
+		/// the count of the broken index is not trusted before the records are allocated
+		uint64_t indexSize = std::filesystem::file_size(p.path(), ec);
+		if (ec || h.count > (indexSize - sizeof(h)) / h.recordSize)continue;
+		std::vector<packRecord> r(size_t(h.count));
+		if (h.count && !f.read(reinterpret_cast<char*>(r.data()), std::streamsize(h.count * sizeof(packRecord))))continue;
+		if (std::any_of(r.begin(), r.end(), [packSize](const packRecord& e) { return e.offset + e.length > packSize; }))continue;
+		uint32_t index = uint32_t(names.size());
+		names.push_back(p.path().stem().string());
+		for (auto& e : r) entries.push_back({ e, index });
+	}
+	std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return memcmp(a.record.md5, b.record.md5, 16) < 0; });
+	return !names.empty();
+}
+
+void fheap::HeapPacks::setMaxPackSize(uint64_t size) {
+	std::scoped_lock guard(lock);
+	_maxPackSize = size;
+}
+
+bool fheap::HeapPacks::find(const std::string& hash, location& where) const {
+	uint8_t md5[16];
+	if (!ScanCache::unhex(hash, md5))return false;
+	std::scoped_lock guard(lock);
+	auto it = std::lower_bound(entries.begin(), entries.end(), md5,
+		[](const entry& a, const uint8_t* b) { return memcmp(a.record.md5, b, 16) < 0; });
+	if (it != entries.end() && memcmp(it->record.md5, md5, 16) == 0) {
+		where.pack = names[it->pack];
+		where.zip = ScanCache::hex(it->record.zip);
+		where.offset = it->record.offset;
+		where.length = it->record.length;
+		where.bundle = it->record.bundle;
+		return true;
+	}
+	auto a = added.find(hash);
+	if (a == added.end())return false;
+	where = a->second;
+	return true;
+}
+
+bool fheap::HeapPacks::append(const std::string& hash, const std::string& zhash, const std::filesystem::path& blob, location& where) {
+	packRecord r;
+	if (!ScanCache::unhex(hash, r.md5) || !ScanCache::unhex(zhash, r.zip))return false;
+	std::ifstream src(blob, std::ios::binary);
+	if (!src.is_open())return false;
+	std::scoped_lock guard(lock);
+	if (!out.is_open()) {
+		/// the name is unique, so the packs made on the different machines do not clash
+		static std::atomic<int> idx = 0;
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		current = std::to_string(us) + "_" + std::to_string(++idx);
+		std::error_code ec;
+		std::filesystem::create_directories(folder, ec);
+		out.open(packPath(current), std::ios::binary | std::ios::trunc);
+		if (!out.is_open())return false;
+		written = 0;
+		bundle = 0;
+		nextBundle = false;
+		records.clear();
+	}
+	if (nextBundle) {
+		bundle++;
+		nextBundle = false;
+	}
+	r.offset = written;
+	r.bundle = bundle;
+	r.reserved = 0;
+	std::unique_ptr<char[]> buf(new char[packBufferSize]);
+	while (src) {
+		src.read(buf.get(), packBufferSize);
+		std::streamsize n = src.gcount();
+		if (n <= 0)break;
+		out.write(buf.get(), n);
+		written += uint64_t(n);
+	}
+	if (src.bad() || !out.good()) {
+		/// the blobs written before are kept, the index does not cover the rest of the pack
+		out.clear();
+		finishPack();
+		return false;
+	}
+	r.length = written - r.offset;
+	records.push_back(r);
+	where.pack = current;
+	where.zip = zhash;
+	where.offset = r.offset;
+	where.length = r.length;
+	where.bundle = r.bundle;
+	added[hash] = where;
+	if (written >= _maxPackSize)return finishPack();
+	return true;
+}
+
+bool fheap::HeapPacks::finishPack() {
+	if (!out.is_open())return true;
+	out.close();
+	bool ok = !out.fail();
+	std::sort(records.begin(), records.end(), [](const packRecord& a, const packRecord& b) { return memcmp(a.md5, b.md5, 16) < 0; });
+	std::filesystem::path idx = folder;
+	idx.append(current + ".idx");
+	std::filesystem::path temp = idx;
+	temp += ".tmp";
+	if (ok) {
+		packIndexHeader h;
+		memcpy(h.magic, packMagic, sizeof(packMagic));
+		h.version = packVersion;
+		h.recordSize = sizeof(packRecord);
+		h.count = records.size();
+		std::ofstream f(temp, std::ios::binary | std::ios::trunc);
+		f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		if (records.size())f.write(reinterpret_cast<const char*>(records.data()), std::streamsize(records.size() * sizeof(packRecord)));
+		f.close();
+		ok = !f.fail();
+	}
+	std::error_code ec;
+	/// the index appears at once, the pack without the index is ignored
+	if (ok)std::filesystem::rename(temp, idx, ec);
+	if (!ok || ec) {
+		std::filesystem::remove(temp, ec);
+		std::filesystem::remove(packPath(current), ec);
+		for (auto& e : records) added.erase(ScanCache::hex(e.md5));
+		records.clear();
+		return false;
+	}
+	uint32_t index = uint32_t(names.size());
+	names.push_back(current);
+	for (auto& e : records) entries.push_back({ e, index });
+	std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return memcmp(a.record.md5, b.record.md5, 16) < 0; });
+	added.clear();
+	records.clear();
+	return true;
+}
+
+void fheap::HeapPacks::startBundle() {
+	std::scoped_lock guard(lock);
+	nextBundle = true;
+}
+
+bool fheap::HeapPacks::finish() {
+	std::scoped_lock guard(lock);
+	return finishPack();
+}
+
+std::vector<std::string> fheap::HeapPacks::hashes() const {
+	std::scoped_lock guard(lock);
+	std::vector<std::string> res;
+	for (auto& e : entries) res.push_back(ScanCache::hex(e.record.md5));
+	for (auto& a : added) res.push_back(a.first);
+	return res;
+}
+
+std::filesystem::path fheap::HeapPacks::packPath(const std::string& pack) const {
+	std::filesystem::path p = folder;
+	p.append(pack + ".pack");
+	return p;
+}
+
+bool fheap::HeapPacks::inflate(const std::string& hash, const zpp::data_callback& onData) const {
+	location where;
+	if (!find(hash, where))return false;
+	std::ifstream src(packPath(where.pack), std::ios::binary);
+	if (!src.is_open() || !src.seekg(std::streamoff(where.offset)))return false;
+	zpp::inflater unzip(onData);
+	std::unique_ptr<char[]> buf(new char[packBufferSize]);
+	uint64_t left = where.length;
+	while (left && !unzip.done()) {
+		src.read(buf.get(), std::streamsize(std::min<uint64_t>(left, packBufferSize)));
+		std::streamsize n = src.gcount();
+		if (n <= 0 || !unzip.feed(buf.get(), size_t(n)))return false;
+		left -= uint64_t(n);
+	}
+	return unzip.done();
+}
+
+bool fheap::HeapPacks::extract(const std::string& hash, const std::string& destFilename, const zpp::data_callback& onData) const {
+	location where;
+	if (!find(hash, where))return false;
+	zpp::createPathForFile(destFilename);
+	std::ofstream f(destFilename, std::ios::binary | std::ios::trunc);
+	if (!f.is_open())return false;
+	bool ok = inflate(hash, [&](const void* data, size_t length) {
+		f.write(static_cast<const char*>(data), length);
+		if (onData)onData(data, length);
+	});
+	f.close();
+	return ok && !f.fail();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "zpp.h"
+
+namespace fheap {
+	/// One blob in the pack index. The index file keeps the records sorted by the md5.
+	struct packRecord {
+		/// md5 of the original file
+		uint8_t md5[16];
+		/// md5 of the blob itself, it is the same as the zip hash of the separate heap file
+		uint8_t zip[16];
+		uint64_t offset;
+		uint64_t length;
+		/// the blobs of the same bundle are the neighbours in the pack, the client may download the whole bundle by one request
+		uint32_t bundle;
+		uint32_t reserved;
+	};
+
+	/**
+	 * \brief The packed part of the heap. The small blobs are not kept as the separate files, they are appended one after another
+	 * to the pack files Packs/<name>.pack, and every pack has the index Packs/<name>.idx. The blob in the pack is the same single-entry
+	 * archive as the separate heap file, so it is checked by the same zip hash, and the client downloads it by the Range request.
+	 * The packs are never changed after they are written, the new blobs go to the new pack.
+	 */
+	class HeapPacks {
+	public:
+		/// where the blob is
+		struct location {
+			std::string pack;
+			std::string zip;
+			uint64_t offset = 0;
+			uint64_t length = 0;
+			uint32_t bundle = 0;
+		};
+	private:
+		struct entry {
+			packRecord record;
+			uint32_t pack;
+		};
+		std::filesystem::path folder;
+		std::vector<std::string> names;
+		/// all the packed blobs sorted by the md5
+		std::vector<entry> entries;
+		/// the blobs appended in this session, they are added to entries when the pack is finished
+		std::map<std::string, location> added;
+		std::vector<packRecord> records;
+		std::string current;
+		std::ofstream out;
+		uint64_t written;
+		uint32_t bundle;
+		bool nextBundle;
+		uint64_t _maxPackSize;
+		mutable std::mutex lock;
+		bool finishPack();
+	public:
+		/// the folder of the packs inside the heap
+		static const char* folderName;
+
+		HeapPacks();
+		~HeapPacks();
+
+		/// Read the indexes of all the packs in the heap, the broken indexes are skipped. Returns false if there are no packs.
+		bool open(const std::filesystem::path& heapPath);
+
+		/// Set the size after which the next blob goes to the new pack, the default is 512 MB
+		void setMaxPackSize(uint64_t size);
+
+		/// Find the blob by the md5 of the original file, the blobs appended in this session are found too. Thread-safe.
+		bool find(const std::string& hash, location& where) const;
+
+		/// Append the blob file to the current pack, returns false if the pack can't be written. Thread-safe.
+		bool append(const std::string& hash, const std::string& zhash, const std::filesystem::path& blob, location& where);
+
+		/// The next appended blob starts the new bundle. The new pack starts the new bundle too.
+		void startBundle();
+
+		/// Write the index of the current pack, the pack is complete after this. Returns false if the index can't be written.
+		bool finish();
+
+		/// The md5 of all the packed files
+		std::vector<std::string> hashes() const;
+
+		/// The path of the pack file
+		std::filesystem::path packPath(const std::string& pack) const;
+
+		/// Unzip the packed blob passing every piece to onData only, returns false if the blob is absent or broken.
+		bool inflate(const std::string& hash, const zpp::data_callback& onData) const;
+
+		/// Unzip the packed blob to the file passing every written piece to onData, returns false if the blob is absent or broken.
+		bool extract(const std::string& hash, const std::string& destFilename, const zpp::data_callback& onData) const;
+	};
+}
@@ -5,9 +5,14 @@
 
 gsproject::Manager::Manager() {
 	SyncDown = true;
+	DeltaVersions = 0;
+	DeltaMaxSize = 16 * 1024 * 1024;
 }
 
 gsproject::Manager::Manager(const std::string& path) {
+	SyncDown = true;
+	DeltaVersions = 0;
+	DeltaMaxSize = 16 * 1024 * 1024;
 	std::cout << "Reading the config " << path << "\n";
 	readConfig(path);
 	std::cout << "done.\n";
@@ -32,6 +37,9 @@ void gsproject::Manager::readConfig(const std::string& path) {
 		if(js.hasKey("SyncDown")) {
 			SyncDown = js["SyncDown"].ToBool();
 		}
+		if(js.hasKey("Threads")) {
+			heap.setThreads(js["Threads"].ToInt());
+		}
 		if(js.hasKey("Exceptions")) {
 			json::JSON& arr = js["Exceptions"];
 			int n = arr.size();
@@ -41,6 +49,28 @@ void gsproject::Manager::readConfig(const std::string& path) {
 				if (exc.length())Exceptions.push_back(exc);
 			}
 		}
+		if(js.hasKey("PackBlobs")) {
+			/// the blobs up to so many KB go to the packs
+			/// the neighbour blobs of the same folder form the bundles up to "BundleSize" KB
+			size_t bundle = js.hasKey("BundleSize") ? size_t(js["BundleSize"].ToInt()) * 1024 : 1024 * 1024;
+			heap.setPackedBlobs(size_t(js["PackBlobs"].ToInt()) * 1024, bundle);
+		}
+		if(js.hasKey("ChunkFiles")) {
+			/// the files from so many MB are split to the chunks of "ChunkSize" KB in average
+			size_t chunk = js.hasKey("ChunkSize") ? size_t(js["ChunkSize"].ToInt()) * 1024 : 1024 * 1024;
+			heap.setChunking(size_t(js["ChunkFiles"].ToInt()) * 1024 * 1024, chunk);
+		}
+		if(js.hasKey("DeltaVersions")) {
+			/// the deltas from so many previous versions for the files up to "DeltaMaxSize" MB
+			DeltaVersions = size_t(js["DeltaVersions"].ToInt());
+			if (js.hasKey("DeltaMaxSize"))DeltaMaxSize = size_t(js["DeltaMaxSize"].ToInt()) * 1024 * 1024;
+		}
+		if(js.hasKey("Priorities")) {
+			/// "Priorities": { "*.exe": 2, "*.dll": 1 }
+			for (auto& [wildcard, priority] : js["Priorities"].ObjectRange()) {
+				if (wildcard.length())Priorities[int(priority.ToInt())].push_back(wildcard);
+			}
+		}
 	}else {
 		std::cout << "ERROR: Project configuration path incorrect!";
 	}
@@ -147,6 +177,24 @@ bool gsproject::Manager::createImage(bool upload, const std::string versionFileN
 	jcc::writeSafeJson(override, ov.string());
 	
 	heap.createDestFolderImage(image, true, true, &Exceptions);
+	if (!Priorities.empty()) {
+		/// the highest matching priority wins
+		std::vector<std::pair<int, jcc::wild_matcher>> classes;
+		for (auto it = Priorities.rbegin(); it != Priorities.rend(); ++it) {
+			classes.emplace_back(it->first, jcc::wild_matcher(it->second));
+		}
+		for (auto& [path, item] : image.ObjectRange()) {
+			if (!item.hasKey("md5"))continue;
+			for (auto& [priority, matcher] : classes) {
+				jcc::wild_matcher::state s = matcher.start();
+				matcher.feed(s, path);
+				if (matcher.matches(s)) {
+					item["priority"] = priority;
+					break;
+				}
+			}
+		}
+	}
 	std::cout << "\n";
 
 	json::JSON versions_list_json;
@@ -155,6 +203,26 @@ bool gsproject::Manager::createImage(bool upload, const std::string versionFileN
 		versions_list_json = json::Array();
 	}
 	std::string relative_path_to_this_version = "Versions/" + this_version_json["Product"].ToString() + this_version_json["Version"].ToString();
+	if (DeltaVersions) {
+		/// the images of the latest previous versions of the product, the list is in the order of the uploads
+		std::vector<json::JSON> previous;
+		for (int i = versions_list_json.size() - 1; i >= 0 && previous.size() < DeltaVersions; i--) {
+			json::JSON& js = versions_list_json[i];
+			if (!js.hasKey("Product") || js["Product"].ToString() != this_version_json["Product"].ToString() || !js.hasKey("Version") ||
+				js["Version"].ToString() == this_version_json["Version"].ToString())continue;
+			std::filesystem::path zp = HeapPath;
+			zp.append("Versions/" + js["Product"].ToString() + js["Version"].ToString());
+			std::string data;
+			zpp::reader r(zp.string());
+			if (r.extractFirst([&data](const void* d, size_t n) { data.append(static_cast<const char*>(d), n); })) {
+				json::JSON prev = json::JSON::Load(data);
+				if (prev.JSONType() == json::JSON::Class::Object)previous.push_back(prev);
+			}
+		}
+		std::cout << "Creating the deltas from " << previous.size() << " previous versions\n";
+		heap.createDeltas(image, previous, DeltaMaxSize);
+		std::cout << "\n";
+	}
 	this_version_json["ImageURL"] = Server + RemoteFilesPath + "/heap/" + relative_path_to_this_version;
 	bool this_version_present = false;
 	for(int i=0;i<versions_list_json.size();i++) {
@@ -196,6 +264,9 @@ bool gsproject::Manager::createImage(bool upload, const std::string versionFileN
 				}
 			}
 		}
+		fheap::HeapPacks packs;
+		packs.open(HeapPath);
+		for (auto& h : packs.hashes()) f << h << "\n";
 		f.close();
 		std::filesystem::path zp = HeapPath;
 		zp.append("Versions/heap.dat");
@@ -1,4 +1,5 @@
 #pragma once
+#include <map>
 #include <string>
 #include <vector>
 
@@ -12,6 +13,8 @@ namespace gsproject {
 		json::JSON image;
 		std::string PathToFiles;
 		std::vector<std::string> Exceptions;
+		/// the wildcards of each priority class, the matching files get the \b "priority" in the image and are downloaded first
+		std::map<int, std::vector<std::string>> Priorities;
 		std::string HeapPath;
 		std::string VersionFileRelativePath;
 		std::string Server;
@@ -19,6 +22,10 @@ namespace gsproject {
 		std::string Bucket;
 		std::string VersionsList;
 		bool SyncDown;
+		/// the deltas are made from so many previous versions of the product, 0 disables them
+		size_t DeltaVersions;
+		/// the biggest file to make the deltas for, bytes
+		size_t DeltaMaxSize;
 	public:
 		Manager();
 		Manager(const std::string& path);
@@ -0,0 +1,263 @@
+#include "HeapFilesSync.h"
+#include "ScanCache.h"
+#include "jcc.h"
+
+#include <algorithm>
+#include <string_view>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fheap {
+	struct cacheHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint64_t count;
+		uint64_t stringsSize;
+	};
+	static const char cacheMagic[8] = { 'A', 'U', 'S', 'C', 'A', 'C', 'H', 'E' };
+	static const uint32_t cacheVersion = 1;
+}
+
+fheap::ScanCache::ScanCache() {
+	data = nullptr;
+	length = 0;
+	records = nullptr;
+	count = 0;
+	strings = nullptr;
+	stringsSize = 0;
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#endif
+}
+
+fheap::ScanCache::~ScanCache() {
+	close();
+}
+
+bool fheap::ScanCache::map(const std::filesystem::path& path) {
+	close();
+#ifdef _WIN32
+	file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)return false;
+	LARGE_INTEGER sz;
+	if (GetFileSizeEx(file, &sz) && sz.QuadPart >= sizeof(cacheHeader)) {
+		mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) {
+			data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			if (data)length = size_t(sz.QuadPart);
+		}
+	}
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(cacheHeader)) {
+		void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			data = static_cast<const uint8_t*>(p);
+			length = size_t(st.st_size);
+		}
+	}
+	::close(fd);
+#endif
+	if (!data) {
+		close();
+		return false;
+	}
+	/// check that the file is not truncated and is of the same format
+	const cacheHeader* h = reinterpret_cast<const cacheHeader*>(data);
+	size_t recordsSize = size_t(h->count) * sizeof(cacheRecord);
+	if (memcmp(h->magic, cacheMagic, sizeof(cacheMagic)) != 0 || h->version != cacheVersion || h->recordSize != sizeof(cacheRecord) ||
+		h->count > length / sizeof(cacheRecord) || h->stringsSize > length || sizeof(cacheHeader) + recordsSize + h->stringsSize != length) {
+		close();
+		return false;
+	}
+	records = reinterpret_cast<const cacheRecord*>(data + sizeof(cacheHeader));
+	count = size_t(h->count);
+	strings = reinterpret_cast<const char*>(data + sizeof(cacheHeader) + recordsSize);
+	stringsSize = size_t(h->stringsSize);
+	return true;
+}
+
+void fheap::ScanCache::close() {
+#ifdef _WIN32
+	if (data)UnmapViewOfFile(data);
+	if (mapping)CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (data)munmap(const_cast<uint8_t*>(data), length);
+#endif
+	data = nullptr;
+	length = 0;
+	records = nullptr;
+	count = 0;
+	strings = nullptr;
+	stringsSize = 0;
+}
+
+bool fheap::ScanCache::open(const std::filesystem::path& binPath, const std::filesystem::path& jsonPath) {
+	if (map(binPath))return true;
+	std::error_code ec;
+	if (!jsonPath.empty() && std::filesystem::exists(jsonPath, ec)) {
+		return importJson(binPath, jsonPath);
+	}
+	return false;
+}
+
+bool fheap::ScanCache::importJson(const std::filesystem::path& binPath, const std::filesystem::path& jsonPath) {
+	json::JSON cache;
+	if (!jcc::readSafeJson(cache, jsonPath.string()) || cache.IsNull())return false;
+	std::vector<std::pair<std::string, cacheRecord>> entries;
+	/// the cache lies in the heap root
+	std::filesystem::path heap = binPath.parent_path();
+	for (auto [key, item] : cache.ObjectRange()) {
+		if (item.hasKey("md5") && item.hasKey("time")) {
+			cacheRecord r;
+			memset(&r, 0, sizeof(r));
+			if (!unhex(item["md5"].ToString(), r.md5))continue;
+			r.flags = cacheRecord::hasMd5 | cacheRecord::legacy;
+			if (item.hasKey("zip") && unhex(item["zip"].ToString(), r.zip))r.flags |= cacheRecord::hasZip;
+			try {
+				r.mtime = int64_t(std::stoll(item["time"].ToString())) * 1000000000;
+				if (item.hasKey("size"))r.zipSize = std::stoull(item["size"].ToString());
+			}
+			catch (std::exception&) {
+				continue;
+			}
+			/// the legacy record matches by the size too, the size of the original file is kept in its heap archive
+			std::string hash = item["md5"].ToString();
+			std::filesystem::path zp = heap;
+			zp.append(hash.substr(0, 2));
+			zp.append(hash);
+			std::error_code ec;
+			if (!std::filesystem::exists(zp, ec))continue;
+			zpp::reader zr(zp.string());
+			uint64_t size;
+			if (!zr.firstFileSize(size))continue;
+			r.size = size;
+			entries.emplace_back(key, r);
+		}
+	}
+	if (!write(binPath, entries))return false;
+	std::error_code ec;
+	std::filesystem::remove(jsonPath, ec);
+	return map(binPath);
+}
+
+size_t fheap::ScanCache::size() const {
+	return count;
+}
+
+bool fheap::ScanCache::find(const std::string& rel, cacheRecord& record) const {
+	if (!count)return false;
+	auto pathOf = [this](const cacheRecord& r) -> std::string_view {
+		if (r.pathOffset + r.pathLength > stringsSize)return std::string_view();
+		return std::string_view(strings + r.pathOffset, r.pathLength);
+	};
+	std::string_view key(rel);
+	const cacheRecord* r = std::lower_bound(records, records + count, key,
+		[&](const cacheRecord& a, const std::string_view& b) { return pathOf(a) < b; });
+	if (r != records + count && pathOf(*r) == key) {
+		record = *r;
+		return true;
+	}
+	return false;
+}
+
+bool fheap::ScanCache::identity(const std::filesystem::path& path, uint64_t& inode, int64_t& ctime) {
+#ifdef _WIN32
+	HANDLE h = CreateFileW(path.wstring().c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	if (h == INVALID_HANDLE_VALUE)return false;
+	BY_HANDLE_FILE_INFORMATION info;
+	FILE_BASIC_INFO basic;
+	bool ok = GetFileInformationByHandle(h, &info) && GetFileInformationByHandleEx(h, FileBasicInfo, &basic, sizeof(basic));
+	CloseHandle(h);
+	if (!ok)return false;
+	inode = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+	ctime = basic.ChangeTime.QuadPart;
+#else
+	struct stat st;
+	if (::stat(path.c_str(), &st) != 0)return false;
+	inode = uint64_t(st.st_ino);
+#ifdef __APPLE__
+	ctime = int64_t(st.st_ctimespec.tv_sec) * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+	ctime = int64_t(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+#endif
+	return true;
+}
+
+bool fheap::ScanCache::write(const std::filesystem::path& binPath, std::vector<std::pair<std::string, cacheRecord>>& entries) {
+	std::sort(entries.begin(), entries.end(),
+		[](const std::pair<std::string, cacheRecord>& a, const std::pair<std::string, cacheRecord>& b) { return a.first < b.first; });
+	cacheHeader h;
+	memcpy(h.magic, cacheMagic, sizeof(cacheMagic));
+	h.version = cacheVersion;
+	h.recordSize = sizeof(cacheRecord);
+	h.count = entries.size();
+	h.stringsSize = 0;
+	for (auto& e : entries) {
+		e.second.pathOffset = h.stringsSize;
+		e.second.pathLength = uint32_t(e.first.length());
+		h.stringsSize += e.first.length();
+	}
+	std::filesystem::path temp = binPath;
+	temp += ".tmp";
+	{
+		std::ofstream f(temp, std::ios::binary);
+		if (!f.is_open())return false;
+		f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		for (auto& e : entries) {
+			f.write(reinterpret_cast<const char*>(&e.second), sizeof(cacheRecord));
+		}
+		for (auto& e : entries) {
+			f.write(e.first.c_str(), e.first.length());
+		}
+		if (!f.good())return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(temp, binPath, ec);
+	if (ec) {
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+std::string fheap::ScanCache::hex(const uint8_t* digest) {
+	const char* chars16 = "0123456789abcdef";
+	std::string s(32, '0');
+	for (int i = 0; i < 16; i++) {
+		s[i * 2] = chars16[digest[i] >> 4];
+		s[i * 2 + 1] = chars16[digest[i] & 15];
+	}
+	return s;
+}
+
+bool fheap::ScanCache::unhex(const std::string& hex, uint8_t* digest) {
+	if (hex.length() != 32)return false;
+	auto nibble = [](char c) -> int {
+		if (c >= '0' && c <= '9')return c - '0';
+		if (c >= 'a' && c <= 'f')return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')return c - 'A' + 10;
+		return -1;
+	};
+	for (int i = 0; i < 16; i++) {
+		int a = nibble(hex[i * 2]);
+		int b = nibble(hex[i * 2 + 1]);
+		if (a < 0 || b < 0)return false;
+		digest[i] = uint8_t((a << 4) | b);
+	}
+	return true;
+}
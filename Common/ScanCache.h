@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fheap {
+	/// One file in the scan cache. The record has the fixed width, the path is kept in the strings table of the cache file.
+	struct cacheRecord {
+		enum {
+			hasMd5 = 1,
+			hasZip = 2,
+			/// imported from the JSON cache, only the whole seconds of the modification time are known, so it matches by the size
+			/// and the seconds once, then the record is rewritten with the full key
+			legacy = 4
+		};
+		uint64_t pathOffset;
+		uint32_t pathLength;
+		uint32_t flags;
+		/// the file size
+		uint64_t size;
+		/// modification time, nanoseconds since the file clock epoch
+		int64_t mtime;
+		/// status change time in the system units, 0 if unknown
+		int64_t ctime;
+		/// inode or the file id, 0 if unknown
+		uint64_t inode;
+		/// size of the zipped file in the heap, 0 if unknown
+		uint64_t zipSize;
+		uint8_t md5[16];
+		uint8_t zip[16];
+	};
+
+	/**
+	 * \brief The binary cache of the destination folder scan. It keeps the sorted table of the fixed width records and the paths table.
+	 * The file is mapped to memory read-only, lookups are the binary search over the mapped records, so opening the cache costs nothing
+	 * no matter how many files it has. The cache is updated by the atomic rewrite of the whole file.
+	 */
+	class ScanCache {
+		const uint8_t* data;
+		size_t length;
+		const cacheRecord* records;
+		size_t count;
+		const char* strings;
+		size_t stringsSize;
+#ifdef _WIN32
+		void* file;
+		void* mapping;
+#endif
+		bool map(const std::filesystem::path& path);
+		bool importJson(const std::filesystem::path& binPath, const std::filesystem::path& jsonPath);
+	public:
+		ScanCache();
+		~ScanCache();
+
+		/// Map the cache file. If it is absent, the legacy JSON cache (if exists) is converted to the binary one.
+		/// The JSON cache has no file sizes, they are taken from the heap archives next to the cache, the records without the archive are dropped.
+		bool open(const std::filesystem::path& binPath, const std::filesystem::path& jsonPath);
+
+		/// Unmap the file. The cache should be closed before it is rewritten.
+		void close();
+
+		/// Amount of the records
+		size_t size() const;
+
+		/// Find the record by the relative path, returns false if the path is absent. Thread-safe.
+		bool find(const std::string& rel, cacheRecord& record) const;
+
+		/// Get the inode (the file id on Windows) and the status change time of the file, returns false if they are unavailable.
+		static bool identity(const std::filesystem::path& path, uint64_t& inode, int64_t& ctime);
+
+		/// Atomically replace the cache file with the new records, the records are sorted by the path. The path inside the records is ignored.
+		static bool write(const std::filesystem::path& binPath, std::vector<std::pair<std::string, cacheRecord>>& entries);
+
+		/// The hex string of the digest
+		static std::string hex(const uint8_t* digest);
+
+		/// Fill the digest from the hex string, returns false if the string is not the md5 hex.
+		static bool unhex(const std::string& hex, uint8_t* digest);
+	};
+}
@@ -1,28 +1,217 @@
 #include "download.h"
 #include "zpp.h"
 
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace downloader {
+	/// the pause before the first retry after the network failure, it doubles with every attempt up to backoffMax
+	static const size_t backoffBase = 300;
+	static const size_t backoffMax = 10000;
+	/// the adaptive mode measures the throughput and changes the amount of the transfers once per this period, milliseconds
+	static const long long adaptPeriod = 1000;
+	/// the mirror that fails so many times in a row is not used for mirrorCooldown milliseconds
+	static const size_t mirrorFailures = 3;
+	static const long long mirrorCooldown = 30000;
+
+	file_writer::file_writer() {
+		used = 0;
+		failed = false;
+#ifdef _WIN32
+		handle = INVALID_HANDLE_VALUE;
+#else
+		fd = -1;
+#endif
+	}
+
+	file_writer::~file_writer() {
+		close();
+	}
+
+	bool file_writer::open(const std::string& path, uint64_t offset, bool truncate) {
+		close();
+		used = 0;
+		failed = false;
+		if (!buffer)buffer.reset(new char[buffer_size]);
+#ifdef _WIN32
+		handle = CreateFileW(std::filesystem::path(path).wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+			truncate && !offset ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (handle == INVALID_HANDLE_VALUE)return false;
+		LARGE_INTEGER pos;
+		pos.QuadPart = LONGLONG(offset);
+		if (!SetFilePointerEx(handle, pos, nullptr, FILE_BEGIN)) {
+			close();
+			return false;
+		}
+#else
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate && !offset ? O_TRUNC : 0), 0644);
+		if (fd < 0)return false;
+		if (lseek(fd, off_t(offset), SEEK_SET) < 0) {
+			close();
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	void file_writer::reserve(uint64_t size) {
+		if (!is_open() || !size)return;
+#ifdef _WIN32
+		FILE_ALLOCATION_INFO info;
+		info.AllocationSize.QuadPart = LONGLONG(size);
+		SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info));
+#elif defined(__linux__)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, off_t(size));
+#endif
+	}
+
+	void file_writer::write(const char* data, size_t size) {
+		while (size && !failed) {
+			size_t n = std::min(size, buffer_size - used);
+			memcpy(buffer.get() + used, data, n);
+			used += n;
+			data += n;
+			size -= n;
+			if (used == buffer_size)flush();
+		}
+	}
+
+	bool file_writer::flush() {
+		const char* p = buffer.get();
+		while (used && !failed) {
+#ifdef _WIN32
+			DWORD written = 0;
+			if (!WriteFile(handle, p, DWORD(used), &written, nullptr) || !written)failed = true;
+#else
+			ssize_t written = ::write(fd, p, used);
+			if (written < 0 && errno == EINTR)continue;
+			if (written <= 0)failed = true;
+#endif
+			else {
+				p += written;
+				used -= size_t(written);
+			}
+		}
+		used = 0;
+		return !failed;
+	}
+
+	bool file_writer::close() {
+		if (!is_open())return !failed;
+		flush();
+#ifdef _WIN32
+		CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+#else
+		if (::close(fd) != 0)failed = true;
+		fd = -1;
+#endif
+		return !failed;
+	}
+
+	bool file_writer::is_open() const {
+#ifdef _WIN32
+		return handle != INVALID_HANDLE_VALUE;
+#else
+		return fd >= 0;
+#endif
+	}
+
+	rate_limiter::rate_limiter(size_t bytes_per_second) {
+		rate = bytes_per_second;
+		tokens = 0;
+		last = std::chrono::steady_clock::now();
+	}
+
+	void rate_limiter::setRate(size_t bytes_per_second) {
+		{
+			std::scoped_lock lock(m);
+			rate = bytes_per_second;
+		}
+		changed.notify_all();
+	}
+
+	size_t rate_limiter::getRate() {
+		std::scoped_lock lock(m);
+		return rate;
+	}
+
+	void rate_limiter::acquire(size_t bytes) {
+		std::unique_lock lock(m);
+		do {
+			if (!rate)return;
+			auto now = std::chrono::steady_clock::now();
+			double capacity = std::max(double(rate) / 4, 65536.0);
+			tokens = std::min(capacity, tokens + std::chrono::duration<double>(now - last).count() * double(rate));
+			last = now;
+			/// the piece bigger than the bucket is taken when the bucket is full, it goes into the debt
+			if (tokens >= double(bytes) || tokens >= capacity) {
+				tokens -= double(bytes);
+				return;
+			}
+			double wait = (std::min(double(bytes), capacity) - tokens) / double(rate);
+			changed.wait_for(lock, std::chrono::duration<double>(std::min(wait, 0.1)));
+		}
+		while (true);
+	}
+
 	queue::queue(int max_threads, int retry_attempts, std::function<bool(size_t, size_t)> progress) {
 		_max_threads = max_threads;
+		_min_threads = max_threads;
+		_active_limit = max_threads;
+		active = 0;
+		windowStart = std::chrono::steady_clock::now();
+		windowBytes = 0;
+		windowFailures = 0;
+		lastThroughput = 0;
+		raised = false;
 		_retry_attempts = retry_attempts;
 		endall = false;
 		allOk = true;
 		allSize = 0;
 		allDownloaded = 0;
+		connectionsOpened = 0;
+		connectionsReused = 0;
+		pending = 0;
+		_segment_size = 0;
+		sequence = 0;
+		_host_failure_budget = _retry_attempts * 2;
+		retries = 0;
+		backoffTime = 0;
+		random.seed(std::random_device()());
 		_progress = std::move(progress);
+		_limiter = nullptr;
+		preferred = 0;
+		_race_bytes = 0;
+		raced = false;
+		racing = false;
 	}
 
 	void queue::waitTheFinish() {
 		m.lock();
 		endall = true;
-		std::vector<std::thread*> temp = threads;
 		m.unlock();
-		for (size_t i = 0; i < temp.size(); i++) {
-			temp[i]->join();
+		cv.notify_all();
+		/// the segmented download may start the new workers, so the list is checked again after the join
+		size_t joined = 0;
+		do {
+			m.lock();
+			std::vector<std::thread*> temp(threads.begin() + joined, threads.end());
+			m.unlock();
+			if (temp.empty())break;
+			for (size_t i = 0; i < temp.size(); i++) {
+				temp[i]->join();
+			}
+			joined += temp.size();
 		}
+		while (true);
 		m.lock();
 		for (size_t i = 0; i < threads.size(); i++) delete(threads[i]);
-		for (size_t i = 0; i < dqueue.size(); i++) delete(dqueue[i]);
+		for (element* de : dqueue) delete(de);
 		threads.clear();
 		dqueue.clear();
 		m.unlock();
@@ -37,177 +226,1056 @@ namespace downloader {
 	}
 
 	void queue::add(const std::string& url, const std::string& to, bool unzip, std::function<void()> ready,
-	                std::function<void(const std::string&)> error) {
+	                std::function<void(const std::string&)> error, const std::string& expected_md5, size_t expected_size, int priority) {
+		if (!endall) {
+			element* de = create(url, to, std::move(ready), std::move(error), expected_md5, expected_size, priority);
+			de->needUnzip = unzip;
+			/// the temporary name is the same for every attempt and every run, so the interrupted download may be continued
+			de->temporary_pos = to + ".download";
+			enqueue(de);
+		}
+	}
+
+	void queue::addInflated(const std::string& url, const std::string& to, const std::string& keep, std::function<void()> ready,
+	                        std::function<void(const std::string&)> error, const std::string& expected_md5,
+	                        const std::string& expected_content_md5, size_t expected_size, int priority) {
 		if (!endall) {
+			element* de = create(url, keep, std::move(ready), std::move(error), expected_md5, expected_size, priority);
+			/// the archive is written only if it is kept
+			if (keep.length())de->temporary_pos = keep + ".download";
+			de->content_pos = to;
+			de->expectedContent = expected_content_md5;
+			enqueue(de);
+		}
+	}
+
+	void queue::addRange(const std::string& url, uint64_t offset, std::vector<piece> pieces, std::function<void()> ready,
+	                     std::function<void(const std::string&)> error, int priority) {
+		if (!endall && pieces.size()) {
+			uint64_t length = 0;
+			for (auto& pc : pieces) length += pc.length;
+			element* de = create(url, "", std::move(ready), std::move(error), "", size_t(length), priority);
+			de->rangeBegin = offset;
+			de->rangeEnd = offset + length;
+			de->pieces = std::move(pieces);
+			enqueue(de);
+		}
+	}
+
+	queue::element* queue::create(const std::string& url, const std::string& to, std::function<void()> ready,
+	                              std::function<void(const std::string&)> error, const std::string& expected_md5, size_t expected_size, int priority) {
+		element* de = new element;
+		de->URL = url;
+		de->final_pos = to;
+		de->needUnzip = false;
+		de->size = 0;
+		de->downloadedSize = 0;
+		de->attempts = 0;
+		de->notBefore = std::chrono::steady_clock::time_point();
+		de->expected = expected_md5;
+		de->expectedSize = expected_size;
+		de->parent = nullptr;
+		de->rangeBegin = 0;
+		de->rangeEnd = 0;
+		de->segmentsLeft = 0;
+		de->segmentFailed = false;
+		de->segmentSize = 0;
+		de->segmentsHashed = 0;
+		de->hashing = false;
+		de->noRanges = false;
+		de->canceled = false;
+		de->piecesDone = 0;
+		de->priority = priority;
+		de->seq = 0;
+		de->mirrored = false;
+		de->mirror = 0;
+		de->ready = std::move(ready);
+		de->error = std::move(error);
+		return de;
+	}
+
+	void queue::enqueue(element* de) {
+		{
 			std::scoped_lock lock(m);
+			de->seq = sequence++;
+			for (auto& mi : mirrors) {
+				if (de->URL.rfind(mi.base, 0) == 0) {
+					de->mirrored = true;
+					de->path = de->URL.substr(mi.base.length());
+					break;
+				}
+			}
+			dqueue.insert(de);
+			pending++;
 
-			element* de = new element;
-			de->URL = url;
-			de->final_pos = to;
-			de->needUnzip = unzip;
-			de->size = 0;
-			de->downloadedSize = 0;
-			de->output = nullptr;
-			de->attempts = 0;
-			de->remove = false;
-			de->ready = std::move(ready);
-			de->error = std::move(error);
-
-			dqueue.push_back(de);
-
-			if (threads.size() < _max_threads) {
-				threads.push_back(new std::thread(
-					[this] {
-						do {
-							element* de = nullptr;
-							m.lock();
-							static size_t didx = rand();
-							for (size_t i = 0; i < dqueue.size(); i++) {
-								if (dqueue[i]->output == nullptr) {
-									de = dqueue[i];
-									break;
-								}
-							}
-							if (de) {
-								de->temporary_pos = de->final_pos + ".download." + std::to_string(didx++);
-								jcc::createPath(de->temporary_pos);
-								de->output = new std::ofstream(de->temporary_pos, std::ios::binary);
-								de->remove = true;
-							}
-							m.unlock();
-							if (de && de->output) {
-								std::string server;
-								std::string com;
-								bool serv = true;
-								for (auto c : de->URL) {
-									if (serv && (c == '/' || c == '\\' || c == '?') && server != "https:" && server !=
-										"http:" && server != "https:/" && server != "http:/")serv = false;
-									if (serv)server += c;
-									else com += c;
-								}
-								bool success = false;
-								if (server.length() && de->output && de->output->is_open()) {
-									httplib::Client cli(server);
-									auto res = cli.Get(com.c_str(),
-									                   [&](const char* data, size_t data_length)-> bool {
-										                   de->output->write(data, data_length);
-										                   return true;
-									                   },
-									                   [&](uint64_t current, uint64_t total)-> bool {
-										                   bool ret = true;
-										                   m.lock();
-										                   allSize += total - de->size;
-										                   allDownloaded += current - de->downloadedSize;
-										                   if (_progress) {
-											                   ret = _progress(allDownloaded, allSize);
-										                   }
-										                   m.unlock();
-										                   de->downloadedSize = current;
-										                   de->size = total;
-										                   return ret;
-									                   });
-									de->output->close();
-									delete(de->output);
-
-									std::filesystem::directory_entry dest(de->final_pos);
-									std::filesystem::directory_entry tmp(de->temporary_pos);
-
-									if (res && res->status == 200) {
-										if (dest.exists()) {
-											std::error_code ec;
-											remove(dest, ec);
-											if (ec.value()) {
-												allOk = false;
-												std::cout << "Unable to remove file: " << dest << ", error: " << ec.
-													message() << "\n";
-											}
-										}
-										if (de->needUnzip) {
-											{
-												zpp::reader w(de->temporary_pos);
-												w.extractFirstToFile(de->final_pos);
-											}
-											if (tmp.exists()) {
-												std::error_code ec;
-												remove(tmp, ec);
-												if (ec.value()) {
-													allOk = false;
-													std::cout << "Unable to remove file: " << ec.message() << "\n";
-												}
-											}
-											if (dest.exists()) {
-												success = true;
-												if (de->ready)de->ready();
-											}
-											else {
-												allOk = false;
-												std::cout << "Missing: " << de->final_pos << "\n";
-												if (de->error)de->error("Unable to unzip");
-											}
-										}
-										else {
-											std::error_code co;
-											rename(tmp, dest, co);
-											if (co.value() == 0) {
-												success = true;
-												if (de->ready)de->ready();
-											}
-											else {
-												allOk = false;
-												std::cout << co.message() << "\n";
-												if (de->error)de->error(co.message());
-											}
-										}
-									}
-									else {
-										if (de->attempts < _retry_attempts) {
-											m.lock();
-											de->attempts++;
-											std::this_thread::sleep_for(std::chrono::milliseconds(300));
-											de->remove = false;
-											m.unlock();
-										}
-										else {
-											if (de->error)de->error("Download failed after all attempts");
-										}
-										allOk = false;
-										std::cout << "Download failed [network failure]: " << de->URL <<
-											" Re-trying, attempt #" << de->attempts << "\n";
-									}
-									std::error_code ec;
-									remove(tmp, ec);
-									if (ec.value()) {
-										allOk = false;
-										std::cout << "Unable to remove temporary file: " << dest << ", error: " << ec.
-											message() << "\n";
-										if (de->error)de->error(ec.message());
-									}
-								}
-								else {
-									allOk = false;
-									std::cout << "Download failed [internal error]: " << de->URL << "\n";
-
-								}
-								m.lock();
-								if (de->remove) {
-									for (auto it = dqueue.begin(); it != dqueue.end(); ++it) {
-										if (*it == de) {
-											delete(de);
-											dqueue.erase(it);
-											break;
-										}
-									}
-								}
-								else de->output = nullptr;
-								m.unlock();
-							}
-							else if (endall)break;
-							std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			startWorkers();
+		}
+		cv.notify_one();
+	}
+
+	void queue::setSegmentSize(size_t segment_size) {
+		std::scoped_lock lock(m);
+		_segment_size = segment_size;
+	}
+
+	bool queue::order::operator()(const element* a, const element* b) const {
+		if (a->priority != b->priority)return a->priority > b->priority;
+		bool sa = a->parent != nullptr;
+		bool sb = b->parent != nullptr;
+		if (sa != sb)return sa;
+		if (a->expectedSize != b->expectedSize) {
+			if (p == largest_first)return a->expectedSize > b->expectedSize;
+			if (p == smallest_first)return a->expectedSize < b->expectedSize;
+		}
+		return a->seq < b->seq;
+	}
+
+	void queue::setPolicy(policy p) {
+		std::scoped_lock lock(m);
+		/// the order of the queued elements is rebuilt with the new rule
+		std::set<element*, order> sorted(order{ p });
+		sorted.insert(dqueue.begin(), dqueue.end());
+		dqueue.swap(sorted);
+	}
+
+	void queue::setMirrors(const std::vector<std::string>& bases) {
+		std::scoped_lock lock(m);
+		mirrors.clear();
+		for (auto& b : bases) {
+			if (b.empty())continue;
+			mirror mi;
+			mi.base = b;
+			mi.requests = 0;
+			mi.failures = 0;
+			mi.failuresInRow = 0;
+			mi.latency = 0;
+			mirrors.push_back(mi);
+		}
+		preferred = 0;
+	}
+
+	void queue::setRace(size_t bytes) {
+		std::scoped_lock lock(m);
+		_race_bytes = bytes;
+	}
+
+	std::vector<queue::mirror_stats> queue::getMirrorStats() {
+		std::scoped_lock lock(m);
+		std::vector<mirror_stats> res;
+		for (auto& mi : mirrors) {
+			res.push_back({ mi.base, mi.requests, mi.failures, mi.latency });
+		}
+		return res;
+	}
+
+	std::string queue::pickUrl(element* de) {
+		std::unique_lock lock(m);
+		if (!de->mirrored || mirrors.empty())return de->URL;
+		/// the other workers wait for the race result
+		raceOver.wait(lock, [this] { return !racing; });
+		auto now = std::chrono::steady_clock::now();
+		/// the first attempt goes to the preferred mirror, the next one goes to the next mirror in the list
+		size_t first = de->attempts == 0 ? preferred : (de->mirror + 1) % mirrors.size();
+		de->mirror = first;
+		for (size_t k = 0; k < mirrors.size(); k++) {
+			size_t i = (first + k) % mirrors.size();
+			if (mirrors[i].downUntil <= now) {
+				de->mirror = i;
+				break;
+			}
+		}
+		return mirrors[de->mirror].base + de->path;
+	}
+
+	void queue::mirrorDone(element* de, bool ok, double latency) {
+		std::scoped_lock lock(m);
+		if (!de->mirrored || de->mirror >= mirrors.size())return;
+		mirror& mi = mirrors[de->mirror];
+		mi.requests++;
+		if (ok) {
+			mi.failuresInRow = 0;
+			mi.latency = mi.latency > 0 ? mi.latency * 0.8 + latency * 0.2 : latency;
+			return;
+		}
+		mi.failures++;
+		if (++mi.failuresInRow < mirrorFailures)return;
+		mi.failuresInRow = 0;
+		mi.downUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(mirrorCooldown);
+		if (mirrors.size() > 1) {
+			std::cout << "The mirror fails, switching to the next one: " << mi.base << "\n";
+			if (preferred == de->mirror)preferred = (preferred + 1) % mirrors.size();
+		}
+	}
+
+	void queue::race(const std::string& path, clients& hosts) {
+		std::vector<std::string> bases;
+		size_t bytes;
+		{
+			std::scoped_lock lock(m);
+			for (auto& mi : mirrors) bases.push_back(mi.base);
+			bytes = _race_bytes;
+			/// the racers besides this worker are the connections too, the workers above the active limit wait for them
+			active += bases.size() - 1;
+		}
+		/// the clients of the worker are created before the racers start, the mirrors on the same server share one, so the rest make their own
+		std::vector<std::string> servers(bases.size());
+		std::vector<std::string> coms(bases.size());
+		std::vector<httplib::Client*> pooled(bases.size(), nullptr);
+		for (size_t i = 0; i < bases.size(); i++) {
+			splitUrl(bases[i] + path, servers[i], coms[i]);
+			if (servers[i].length() && std::find(servers.begin(), servers.begin() + i, servers[i]) == servers.begin() + i) {
+				pooled[i] = &client(hosts, servers[i]);
+			}
+		}
+		/// every mirror downloads the first bytes of the same file at once, the first to finish is used for the rest of the session
+		std::vector<double> times(bases.size(), 0);
+		std::vector<char> broken(bases.size(), false);
+		std::vector<std::thread> racers;
+		for (size_t i = 0; i < bases.size(); i++) {
+			racers.emplace_back([&, i] {
+				const std::string& server = servers[i];
+				const std::string& com = coms[i];
+				if (server.empty())return;
+				std::unique_ptr<httplib::Client> own;
+				if (!pooled[i])own.reset(new httplib::Client(server));
+				httplib::Client& cli = pooled[i] ? *pooled[i] : *own;
+				httplib::Headers headers;
+				headers.emplace("Range", "bytes=0-" + std::to_string(bytes - 1));
+				size_t got = 0;
+				bool accepted = false;
+				auto start = std::chrono::steady_clock::now();
+				auto res = cli.Get(com.c_str(), headers,
+				                   [&](const httplib::Response& response)-> bool {
+					                   accepted = response.status == 200 || response.status == 206;
+					                   return accepted;
+				                   },
+				                   [&](const char*, size_t data_length)-> bool {
+					                   got += data_length;
+					                   return got <= bytes;
+				                   });
+				/// the server that ignores the range is stopped after the first bytes
+				if (accepted && (res || got >= bytes)) {
+					times[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				}
+				broken[i] = !res;
+			});
+		}
+		for (auto& t : racers) t.join();
+		/// the stopped transfer leaves the connection in the middle of the response
+		for (size_t i = 0; i < bases.size(); i++) {
+			if (pooled[i] && broken[i])hosts.erase(servers[i]);
+		}
+		std::scoped_lock lock(m);
+		active -= bases.size() - 1;
+		if (mirrors.size() != bases.size())return;
+		size_t best = mirrors.size();
+		for (size_t i = 0; i < times.size(); i++) {
+			if (times[i] > 0) {
+				mirrors[i].latency = times[i];
+				if (best == mirrors.size() || times[i] < times[best])best = i;
+			}
+		}
+		if (best < mirrors.size()) {
+			preferred = best;
+			std::cout << "The fastest mirror: " << mirrors[best].base << ", " << times[best] << " ms\n";
+		}
+	}
+
+	void queue::setRateLimiter(rate_limiter* limiter) {
+		std::scoped_lock lock(m);
+		_limiter = limiter;
+	}
+
+	void queue::setAdaptive(size_t min_threads, size_t max_threads) {
+		std::scoped_lock lock(m);
+		_min_threads = std::max<size_t>(1, min_threads);
+		_max_threads = std::max(_min_threads, max_threads);
+		_active_limit = std::clamp(_active_limit, _min_threads, _max_threads);
+		windowStart = std::chrono::steady_clock::now();
+		windowBytes = 0;
+		windowFailures = 0;
+		startWorkers();
+	}
+
+	void queue::startWorkers() {
+		while (threads.size() < _active_limit && threads.size() < pending) {
+			threads.push_back(new std::thread([this] { work(); }));
+		}
+	}
+
+	void queue::adapt() {
+		if (_min_threads >= _max_threads)return;
+		auto now = std::chrono::steady_clock::now();
+		long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - windowStart).count();
+		if (elapsed < adaptPeriod)return;
+		double throughput = double(windowBytes) * 1000 / double(elapsed);
+		size_t limit = _active_limit;
+		/// the failures or the throughput drop after the increase mean the link is overloaded, the transfers are halved.
+		/// Otherwise one more transfer is tried while all the transfers are busy and there are the elements waiting.
+		if (windowFailures || (raised && throughput < lastThroughput * 0.75)) {
+			_active_limit = std::max(_min_threads, _active_limit / 2);
+		}
+		else if (active >= _active_limit && !dqueue.empty() && _active_limit < _max_threads) {
+			_active_limit++;
+		}
+		raised = _active_limit > limit;
+		lastThroughput = throughput;
+		windowStart = now;
+		windowBytes = 0;
+		windowFailures = 0;
+		if (raised) {
+			startWorkers();
+			cv.notify_one();
+		}
+	}
+
+	void queue::work() {
+		clients hosts;
+		do {
+			element* de = nullptr;
+			bool segment = false;
+			bool resumed = false;
+			bool raceFirst = false;
+			{
+				std::unique_lock lock(m);
+				/// the element waiting for the retry is skipped till its pause is over, the worker sleeps till the nearest one is ready
+				do {
+					auto now = std::chrono::steady_clock::now();
+					auto next = std::chrono::steady_clock::time_point::max();
+					auto it = dqueue.end();
+					/// the workers above the active limit stay idle
+					if (active < _active_limit) {
+						for (it = dqueue.begin(); it != dqueue.end() && (*it)->notBefore > now; ++it) {
+							next = std::min(next, (*it)->notBefore);
 						}
-						while (TRUE);
-					}));
+					}
+					if (it != dqueue.end()) {
+						de = *it;
+						dqueue.erase(it);
+						break;
+					}
+					if (dqueue.empty() && endall && pending == 0)break;
+					if (next == std::chrono::steady_clock::time_point::max())cv.wait(lock);
+					else cv.wait_until(lock, next);
+				}
+				while (true);
+				if (!de)break;
+				segment = de->parent != nullptr;
+				if (!segment && _segment_size && !de->noRanges && de->content_pos.empty() && de->pieces.empty() && de->expectedSize > _segment_size) {
+					if (split(de))continue;
+					/// all the segments were downloaded by the previous run
+					resumed = true;
+				}
+				/// the split element is not downloaded itself, its first segment makes the race
+				if (_race_bytes && !raced && de->mirrored && mirrors.size() > 1 && !resumed) {
+					raced = true;
+					racing = true;
+					raceFirst = true;
+				}
+				active++;
+			}
+			if (raceFirst) {
+				race(de->path, hosts);
+				raceFirst = false;
+				{
+					std::scoped_lock lock(m);
+					racing = false;
+				}
+				raceOver.notify_all();
+				/// the racers are not active any more, the idle workers may go on
+				cv.notify_all();
+			}
+			bool retry = resumed ? finishSegmented(de) : segment ? downloadSegment(de, hosts) : de->pieces.size() ? downloadPieces(de, hosts) : download(de, hosts);
+			if (segment && !retry) {
+				/// the last finished segment completes the whole element
+				element* whole = de->parent;
+				if (!segmentFinished(de)) {
+					cv.notify_all();
+					continue;
+				}
+				de = whole;
+				retry = finishSegmented(de);
+			}
+			{
+				std::scoped_lock lock(m);
+				active--;
+				if (retry) {
+					dqueue.insert(de);
+				}
+				else {
+					delete(de);
+					pending--;
+				}
+				adapt();
+			}
+			if (retry)cv.notify_one();
+			else cv.notify_all();
+		}
+		while (true);
+	}
+
+	bool queue::split(element* de) {
+		jcc::createPath(de->temporary_pos);
+		std::string meta = de->temporary_pos + ".meta";
+		size_t count = (de->expectedSize + _segment_size - 1) / _segment_size;
+		de->segmentSize = _segment_size;
+		de->segmentsDone.assign(count, false);
+		de->segmentsHashed = 0;
+		de->hashing = false;
+		de->segmentFailed = false;
+		de->validator.clear();
+		de->digest.init();
+		/// the file of the interrupted download is continued if it was split the same way, the server checks the validator (If-Range)
+		std::error_code ec;
+		{
+			std::ifstream mf(meta);
+			std::string url;
+			std::string validator;
+			std::string done;
+			uint64_t size = 0;
+			size_t segmentSize = 0;
+			if (std::getline(mf, url) && url == de->URL && std::getline(mf, validator) && validator.length() && mf >> size >> segmentSize >> done &&
+				size == de->expectedSize && segmentSize == _segment_size && done.length() == count &&
+				std::filesystem::file_size(de->temporary_pos, ec) == size && !ec) {
+				de->validator = validator;
+				for (size_t i = 0; i < count; i++) de->segmentsDone[i] = done[i] == '1';
+			}
+		}
+		if (de->validator.empty()) {
+			/// the file gets its full size at once, so the segments write to their own places and the disk space is not fragmented
+			std::filesystem::remove(meta, ec);
+			{
+				file_writer f;
+				if (f.open(de->temporary_pos, 0, true))f.reserve(de->expectedSize);
 			}
+			std::filesystem::resize_file(de->temporary_pos, de->expectedSize, ec);
+			if (ec.value()) {
+				std::cout << "Unable to allocate " << de->temporary_pos << ", error: " << ec.message() << "\n";
+				de->noRanges = true;
+				dqueue.insert(de);
+				return true;
+			}
+		}
+		de->segmentsLeft = size_t(std::count(de->segmentsDone.begin(), de->segmentsDone.end(), false));
+		if (!de->segmentsLeft)return false;
+		/// the segments go before the other elements of the same priority, so all the free workers join the element that was just taken
+		for (size_t i = 0; i < count; i++) {
+			if (de->segmentsDone[i])continue;
+			element* s = create(de->URL, "", nullptr, nullptr, "", 0, de->priority);
+			s->parent = de;
+			s->rangeBegin = uint64_t(i) * _segment_size;
+			s->rangeEnd = std::min<uint64_t>(s->rangeBegin + _segment_size, de->expectedSize);
+			s->seq = sequence++;
+			s->mirrored = de->mirrored;
+			s->path = de->path;
+			s->mirror = de->mirror;
+			dqueue.insert(s);
+		}
+		pending += de->segmentsLeft;
+		startWorkers();
+		cv.notify_all();
+		return true;
+	}
+
+	bool queue::retryLater(element* de, const std::string& server, bool network) {
+		std::scoped_lock lock(m);
+		if (de->attempts >= _retry_attempts)return false;
+		size_t delay = 0;
+		/// the corrupted data is re-downloaded at once, the network failure needs a pause
+		if (network) {
+			windowFailures++;
+			size_t& failures = hostFailures[server];
+			failures++;
+			/// the failing mirror is replaced by the other ones, so the budget is for the single server only
+			if (_host_failure_budget && failures > _host_failure_budget && !(de->mirrored && mirrors.size() > 1)) {
+				/// the host fails everything, so the rest of its downloads do not wait for all their attempts
+				if (failures == _host_failure_budget + 1)std::cout << "Too many failures in a row, giving up: " << server << "\n";
+				return false;
+			}
+			/// the next mirror is tried at once, the pause is made when all the mirrors have failed
+			bool failover = de->mirrored && mirrors.size() > 1 && (de->attempts + 1) % mirrors.size() != 0;
+			if (!failover) {
+				/// the random part spreads the retries of the different workers, so they do not hit the server at once
+				size_t round = de->mirrored && mirrors.size() > 1 ? de->attempts / mirrors.size() : de->attempts;
+				size_t pause = std::min(backoffMax, backoffBase << std::min<size_t>(round, 16));
+				delay = pause / 2 + random() % (pause / 2 + 1);
+			}
+		}
+		de->attempts++;
+		de->notBefore = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+		retries++;
+		backoffTime += delay;
+		return true;
+	}
+
+	void queue::hostSucceeded(const std::string& server) {
+		std::scoped_lock lock(m);
+		hostFailures[server] = 0;
+	}
+
+	void queue::setHostFailureBudget(size_t failures) {
+		std::scoped_lock lock(m);
+		_host_failure_budget = failures;
+	}
+
+	void queue::splitUrl(const std::string& url, std::string& server, std::string& path) {
+		bool serv = true;
+		for (auto c : url) {
+			if (serv && (c == '/' || c == '\\' || c == '?') && server != "https:" && server !=
+				"http:" && server != "https:/" && server != "http:/")serv = false;
+			if (serv)server += c;
+			else path += c;
+		}
+	}
+
+	httplib::Client& queue::client(clients& hosts, const std::string& server) {
+		std::unique_ptr<httplib::Client>& client = hosts[server];
+		if (!client) {
+			client.reset(new httplib::Client(server));
+			client->set_keep_alive(true);
+		}
+		std::scoped_lock lock(m);
+		if (client->is_socket_open())connectionsReused++;
+		else connectionsOpened++;
+		return *client;
+	}
+
+	bool queue::reportProgress(element* de, uint64_t current, uint64_t total) {
+		bool ret = true;
+		m.lock();
+		if (current > de->downloadedSize)windowBytes += current - de->downloadedSize;
+		adapt();
+		allSize += total - de->size;
+		allDownloaded += current - de->downloadedSize;
+		if (_progress) {
+			ret = _progress(allDownloaded, allSize);
+		}
+		m.unlock();
+		de->downloadedSize = current;
+		de->size = total;
+		if (!ret)de->canceled = true;
+		return ret;
+	}
+
+	bool queue::download(element* de, clients& hosts) {
+		bool inflate = de->content_pos.length() > 0;
+		bool keepArchive = de->temporary_pos.length() > 0;
+		if (keepArchive)jcc::createPath(de->temporary_pos);
+		std::string meta = de->temporary_pos + ".meta";
+		/// the data already downloaded by the previous attempt (or the previous run) is continued
+		/// if the server confirms it is the same file (If-Range), the meta file keeps the URL and the ETag or Last-Modified
+		uint64_t offset = 0;
+		std::string validator;
+		if (!inflate) {
+			std::error_code ec;
+			uint64_t have = std::filesystem::file_size(de->temporary_pos, ec);
+			std::ifstream mf(meta);
+			std::string url;
+			/// the meta file of the segmented download has the list of the segments, its file is not the continuous beginning
+			std::string segments;
+			if (!ec && have > 0 && std::getline(mf, url) && url == de->URL && std::getline(mf, validator) && validator.length() && !std::getline(mf, segments)) {
+				offset = have;
+			}
+		}
+		de->digest.init();
+		if (offset && de->expected.length()) {
+			std::ifstream part(de->temporary_pos, std::ios::binary);
+			std::unique_ptr<char[]> buf(new char[md5::file_buffer_size]);
+			uint64_t left = offset;
+			while (left && part.read(buf.get(), std::streamsize(std::min<uint64_t>(left, md5::file_buffer_size)))) {
+				de->digest.update(buf.get(), size_t(part.gcount()));
+				left -= uint64_t(part.gcount());
+			}
+			if (left) {
+				offset = 0;
+				de->digest.init();
+			}
+		}
+		file_writer output;
+		if (keepArchive)output.open(de->temporary_pos, offset, true);
+		/// the unzipped data goes to its file at once, the archive is not read again
+		file_writer content;
+		std::unique_ptr<zpp::inflater> unzip;
+		bool broken = false;
+		if (inflate) {
+			jcc::createPath(de->content_pos);
+			content.open(de->content_pos, 0, true);
+			de->contentDigest.init();
+			unzip.reset(new zpp::inflater([&](const void* data, size_t length) {
+				content.write(static_cast<const char*>(data), length);
+				if (de->expectedContent.length())de->contentDigest.update(data, length);
+			}));
+		}
+		std::string server;
+		std::string com;
+		splitUrl(pickUrl(de), server, com);
+		bool retry = false;
+		if (server.length() && (output.is_open() || !keepArchive) && (content.is_open() || !inflate)) {
+			httplib::Client& cli = client(hosts, server);
+			auto start = std::chrono::steady_clock::now();
+			double latency = 0;
+			httplib::Headers headers;
+			if (offset) {
+				headers.emplace("Range", "bytes=" + std::to_string(offset) + "-");
+				headers.emplace("If-Range", validator);
+			}
+			/// the body is written only if it is the expected data, not the error page
+			bool accepted = false;
+			auto res = cli.Get(com.c_str(), headers,
+			                   [&](const httplib::Response& response)-> bool {
+				                   latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				                   if (response.status == 206 && offset) {
+					                   accepted = true;
+				                   }
+				                   else if (response.status == 200) {
+					                   if (offset) {
+						                   /// the file was changed or the server ignores the range, start from the beginning
+						                   output.close();
+						                   output.open(de->temporary_pos, 0, true);
+						                   de->digest.init();
+						                   offset = 0;
+					                   }
+					                   accepted = true;
+					                   if (!inflate) {
+						                   std::string v = response.get_header_value("ETag");
+						                   /// the weak ETag can't be used in If-Range
+						                   if (v.empty() || v.rfind("W/", 0) == 0)v = response.get_header_value("Last-Modified");
+						                   std::ofstream mf(meta, std::ios::trunc);
+						                   mf << de->URL << "\n" << v << "\n";
+					                   }
+				                   }
+				                   /// the space for the whole file is reserved at once
+				                   if (accepted)output.reserve(offset + std::strtoull(response.get_header_value("Content-Length").c_str(), nullptr, 10));
+				                   return true;
+			                   },
+			                   [&](const char* data, size_t data_length)-> bool {
+				                   if (accepted) {
+					                   if (_limiter)_limiter->acquire(data_length);
+					                   if (keepArchive)output.write(data, data_length);
+					                   if (de->expected.length())de->digest.update(data, data_length);
+					                   /// the broken archive is not downloaded to the end
+					                   if (inflate && !unzip->feed(data, data_length)) {
+						                   broken = true;
+						                   return false;
+					                   }
+				                   }
+				                   return true;
+			                   },
+			                   [&](uint64_t current, uint64_t total)-> bool {
+				                   return reportProgress(de, current + offset, total + offset);
+			                   });
+			bool written = output.close();
+			if (!content.close())written = false;
+
+			std::filesystem::directory_entry dest(de->final_pos);
+			std::filesystem::directory_entry tmp(de->temporary_pos);
+
+			/// the connection may be broken, the next attempt starts with the new one
+			if (!res)hosts.erase(server);
+
+			bool received = res && accepted && written;
+			/// the data is hashed while it arrives, so the corrupted data is detected without reading the file again
+			bool corrupted = broken || (received && de->expected.length() && de->digest.final() != de->expected);
+			if (received && inflate && !corrupted) {
+				corrupted = !unzip->done() || (de->expectedContent.length() && de->contentDigest.final() != de->expectedContent);
+			}
+			/// the partial data is kept for the next attempt if the transfer was just interrupted, the unzipping can't be continued
+			bool keep = !inflate && !received && !(res && res->status != 200 && res->status != 206);
+			if (!de->canceled)mirrorDone(de, received && !corrupted, latency);
+			if (received && !corrupted) {
+				hostSucceeded(server);
+				complete(de);
+			}
+			else if (de->canceled) {
+				/// the partial data is kept, the next run continues it
+				allOk = false;
+				std::cout << "Download canceled: " << de->URL << "\n";
+				if (de->error)de->error("Canceled");
+			}
+			else {
+				retry = retryLater(de, server, !corrupted);
+				if (!retry && de->error)de->error(corrupted ? "ServerDataCorrupted" : "Download failed after all attempts");
+				allOk = false;
+				std::cout << (corrupted ? "Download failed [corrupted data]: " : "Download failed [network failure]: ") << de->URL <<
+					" Re-trying, attempt #" << de->attempts << "\n";
+			}
+			std::error_code ec;
+			if (!keep && keepArchive) {
+				std::filesystem::remove(meta, ec);
+				remove(tmp, ec);
+			}
+			if (inflate && (!received || corrupted))std::filesystem::remove(de->content_pos, ec);
+			if (ec.value()) {
+				allOk = false;
+				std::cout << "Unable to remove temporary file: " << dest << ", error: " << ec.
+					message() << "\n";
+				if (de->error)de->error(ec.message());
+			}
+		}
+		else {
+			allOk = false;
+			std::cout << "Download failed [internal error]: " << de->URL << "\n";
+		}
+		return retry;
+	}
+
+	void queue::complete(element* de) {
+		/// the unzipped data is already in place and the archive is not kept
+		if (de->content_pos.length() && de->temporary_pos.empty()) {
+			if (de->ready)de->ready();
+			return;
+		}
+		std::filesystem::directory_entry dest(de->final_pos);
+		std::filesystem::directory_entry tmp(de->temporary_pos);
+		if (dest.exists()) {
+			std::error_code ec;
+			remove(dest, ec);
+			if (ec.value()) {
+				allOk = false;
+				std::cout << "Unable to remove file: " << dest << ", error: " << ec.
+					message() << "\n";
+			}
+		}
+		if (de->needUnzip) {
+			{
+				zpp::reader w(de->temporary_pos);
+				w.extractFirstToFile(de->final_pos);
+			}
+			if (tmp.exists()) {
+				std::error_code ec;
+				remove(tmp, ec);
+				if (ec.value()) {
+					allOk = false;
+					std::cout << "Unable to remove file: " << ec.message() << "\n";
+				}
+			}
+			if (dest.exists()) {
+				if (de->ready)de->ready();
+			}
+			else {
+				allOk = false;
+				std::cout << "Missing: " << de->final_pos << "\n";
+				if (de->error)de->error("Unable to unzip");
+			}
+		}
+		else {
+			std::error_code co;
+			rename(tmp, dest, co);
+			if (co.value() == 0) {
+				if (de->ready)de->ready();
+			}
+			else {
+				allOk = false;
+				std::cout << co.message() << "\n";
+				if (de->error)de->error(co.message());
+			}
+		}
+	}
+
+	bool queue::downloadSegment(element* de, clients& hosts) {
+		element* whole = de->parent;
+		{
+			/// the other segment has failed, there is no sense to continue
+			std::scoped_lock lock(m);
+			if (whole->noRanges || whole->segmentFailed)return false;
+		}
+		std::string server;
+		std::string com;
+		splitUrl(pickUrl(de), server, com);
+		file_writer output;
+		if (!server.length() || !output.open(whole->temporary_pos, de->rangeBegin, false)) {
+			std::scoped_lock lock(m);
+			allOk = false;
+			whole->segmentFailed = true;
+			std::cout << "Download failed [internal error]: " << de->URL << "\n";
+			return false;
+		}
+		httplib::Client& cli = client(hosts, server);
+		httplib::Headers headers;
+		headers.emplace("Range", "bytes=" + std::to_string(de->rangeBegin) + "-" + std::to_string(de->rangeEnd - 1));
+		{
+			/// the segments are parts of the same file only if it is not changed on the server, the changed file comes as the whole (200)
+			std::scoped_lock lock(m);
+			if (whole->validator.length())headers.emplace("If-Range", whole->validator);
+		}
+		uint64_t length = de->rangeEnd - de->rangeBegin;
+		uint64_t received = 0;
+		auto start = std::chrono::steady_clock::now();
+		double latency = 0;
+		auto res = cli.Get(com.c_str(), headers,
+		                   [&](const httplib::Response& response)-> bool {
+			                   latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			                   if (response.status == 206) {
+				                   std::string v = response.get_header_value("ETag");
+				                   /// the weak ETag can't be used in If-Range
+				                   if (v.empty() || v.rfind("W/", 0) == 0)v = response.get_header_value("Last-Modified");
+				                   std::scoped_lock lock(m);
+				                   if (whole->validator.empty())whole->validator = v;
+				                   return true;
+			                   }
+			                   if (response.status == 200) {
+				                   /// the server ignores the range or the file was changed, the element is downloaded as the whole
+				                   std::scoped_lock lock(m);
+				                   whole->noRanges = true;
+			                   }
+			                   return false;
+		                   },
+		                   [&](const char* data, size_t data_length)-> bool {
+			                   if (received + data_length > length)return false;
+			                   if (_limiter)_limiter->acquire(data_length);
+			                   output.write(data, data_length);
+			                   received += data_length;
+			                   return true;
+		                   },
+		                   [&](uint64_t current, uint64_t total)-> bool {
+			                   return reportProgress(de, current, total);
+		                   });
+		bool written = output.close();
+		if (!res)hosts.erase(server);
+		bool done = res && received == length && written;
+		if (de->canceled) {
+			/// the other segments stop too, the finished ones are kept for the next run
+			std::scoped_lock lock(m);
+			allOk = false;
+			whole->canceled = true;
+			whole->segmentFailed = true;
+			return false;
+		}
+		mirrorDone(de, done, latency);
+		if (done) {
+			hostSucceeded(server);
+			std::scoped_lock lock(m);
+			whole->segmentsDone[size_t(de->rangeBegin / whole->segmentSize)] = true;
+			writeSegments(whole);
+			return false;
+		}
+		{
+			std::scoped_lock lock(m);
+			if (whole->noRanges)return false;
+			allOk = false;
+		}
+		bool retry = retryLater(de, server, true);
+		if (!retry) {
+			std::scoped_lock lock(m);
+			whole->segmentFailed = true;
+		}
+		std::cout << "Download failed [network failure]: " << de->URL << " bytes " << de->rangeBegin << "-" << de->rangeEnd - 1;
+		if (retry)std::cout << " Re-trying, attempt #" << de->attempts;
+		std::cout << "\n";
+		return retry;
+	}
+
+	bool queue::segmentFinished(element* de) {
+		element* whole = de->parent;
+		std::unique_lock lock(m);
+		whole->size += de->size;
+		whole->downloadedSize += de->downloadedSize;
+		delete(de);
+		pending--;
+		whole->segmentsLeft--;
+		/// the worker that hashes now continues with the segment finished just now, it also finishes the element if it was the last one
+		bool last = false;
+		if (!whole->hashing) {
+			hashSegments(whole, lock);
+			last = whole->segmentsLeft == 0;
+		}
+		if (!last)active--;
+		adapt();
+		return last;
+	}
+
+	void queue::hashSegments(element* whole, std::unique_lock<std::mutex>& lock) {
+		if (whole->hashing || whole->expected.empty())return;
+		whole->hashing = true;
+		std::unique_ptr<char[]> buf;
+		while (whole->segmentsHashed < whole->segmentsDone.size() && whole->segmentsDone[whole->segmentsHashed] && !whole->noRanges &&
+			!whole->segmentFailed) {
+			uint64_t from = uint64_t(whole->segmentsHashed) * whole->segmentSize;
+			uint64_t left = std::min<uint64_t>(whole->segmentSize, whole->expectedSize - from);
+			lock.unlock();
+			/// the segment was written just now, so it is read from the cache
+			if (!buf)buf.reset(new char[md5::file_buffer_size]);
+			std::ifstream f(whole->temporary_pos, std::ios::binary);
+			f.seekg(std::streamoff(from));
+			while (left && f.read(buf.get(), std::streamsize(std::min<uint64_t>(left, md5::file_buffer_size)))) {
+				whole->digest.update(buf.get(), size_t(f.gcount()));
+				left -= uint64_t(f.gcount());
+			}
+			lock.lock();
+			/// the unread segment leaves the hash incomplete, the file is downloaded again
+			if (left)break;
+			whole->segmentsHashed++;
+		}
+		whole->hashing = false;
+	}
+
+	void queue::writeSegments(element* whole) {
+		/// the segments can be continued only if the server confirms the file is the same
+		if (whole->validator.empty())return;
+		std::ofstream mf(whole->temporary_pos + ".meta", std::ios::trunc);
+		mf << whole->URL << "\n" << whole->validator << "\n" << whole->expectedSize << " " << whole->segmentSize << "\n";
+		for (bool done : whole->segmentsDone) mf << (done ? '1' : '0');
+		mf << "\n";
+	}
+
+	bool queue::downloadPieces(element* de, clients& hosts) {
+		/// the parts received by the previous attempts are not downloaded again
+		uint64_t from = de->rangeBegin;
+		for (size_t i = 0; i < de->piecesDone; i++) from += de->pieces[i].length;
+		std::string server;
+		std::string com;
+		splitUrl(pickUrl(de), server, com);
+		if (!server.length()) {
+			allOk = false;
+			std::cout << "Download failed [internal error]: " << de->URL << "\n";
+			return false;
+		}
+		httplib::Client& cli = client(hosts, server);
+		httplib::Headers headers;
+		headers.emplace("Range", "bytes=" + std::to_string(from) + "-" + std::to_string(de->rangeEnd - 1));
+		file_writer output;
+		/// the part being received and its received bytes
+		size_t current = de->piecesDone;
+		uint64_t filled = 0;
+		uint64_t received = from - de->rangeBegin;
+		/// the server that ignores the range sends the whole file, the bytes before the range are skipped and the rest is not read
+		bool whole = false;
+		uint64_t skip = 0;
+		bool corrupted = false;
+		auto finishPiece = [&](const piece& pc) -> bool {
+			if (pc.to.empty())return true;
+			std::string temp = pc.to + ".download";
+			std::error_code ec;
+			if (!output.close() || (pc.expected_md5.length() && de->digest.final() != pc.expected_md5)) {
+				std::filesystem::remove(temp, ec);
+				return false;
+			}
+			std::filesystem::remove(pc.to, ec);
+			std::filesystem::rename(temp, pc.to, ec);
+			return !ec;
+		};
+		auto start = std::chrono::steady_clock::now();
+		double latency = 0;
+		auto res = cli.Get(com.c_str(), headers,
+		                   [&](const httplib::Response& response)-> bool {
+			                   latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			                   if (response.status == 200) {
+				                   whole = true;
+				                   skip = from;
+			                   }
+			                   return response.status == 206 || response.status == 200;
+		                   },
+		                   [&](const char* data, size_t data_length)-> bool {
+			                   if (_limiter)_limiter->acquire(data_length);
+			                   size_t n = size_t(std::min<uint64_t>(skip, data_length));
+			                   skip -= n;
+			                   data += n;
+			                   data_length -= n;
+			                   while (data_length && current < de->pieces.size()) {
+				                   const piece& pc = de->pieces[current];
+				                   if (!filled && pc.to.length()) {
+					                   jcc::createPath(pc.to);
+					                   if (!output.open(pc.to + ".download", 0, true))return false;
+					                   de->digest.init();
+				                   }
+				                   n = size_t(std::min<uint64_t>(pc.length - filled, data_length));
+				                   if (pc.to.length()) {
+					                   output.write(data, n);
+					                   if (pc.expected_md5.length())de->digest.update(data, n);
+				                   }
+				                   filled += n;
+				                   received += n;
+				                   data += n;
+				                   data_length -= n;
+				                   if (filled == pc.length) {
+					                   if (!finishPiece(pc)) {
+						                   corrupted = true;
+						                   return false;
+					                   }
+					                   de->piecesDone = ++current;
+					                   filled = 0;
+				                   }
+			                   }
+			                   if (!reportProgress(de, received, de->rangeEnd - de->rangeBegin))return false;
+			                   return current < de->pieces.size() || !whole;
+		                   });
+		output.close();
+		bool complete = de->piecesDone == de->pieces.size();
+		if (!res)hosts.erase(server);
+		if (!de->canceled)mirrorDone(de, complete, latency);
+		if (complete) {
+			hostSucceeded(server);
+			if (de->ready)de->ready();
+			return false;
+		}
+		if (filled && current < de->pieces.size() && de->pieces[current].to.length()) {
+			std::error_code ec;
+			std::filesystem::remove(de->pieces[current].to + ".download", ec);
+		}
+		allOk = false;
+		if (de->canceled) {
+			/// the finished parts are kept, the rest is not downloaded
+			std::cout << "Download canceled: " << de->URL << "\n";
+			if (de->error)de->error("Canceled");
+			return false;
+		}
+		bool retry = retryLater(de, server, !corrupted);
+		if (!retry && de->error)de->error(corrupted ? "ServerDataCorrupted" : "Download failed after all attempts");
+		std::cout << (corrupted ? "Download failed [corrupted data]: " : "Download failed [network failure]: ") << de->URL << " bytes " << from <<
+			"-" << de->rangeEnd - 1 << " Re-trying, attempt #" << de->attempts << "\n";
+		return retry;
+	}
+
+	bool queue::finishSegmented(element* de) {
+		bool retry = false;
+		/// the segments are hashed while they are finished, the ones of the previous run are hashed here
+		{
+			std::unique_lock lock(m);
+			hashSegments(de, lock);
+		}
+		std::string meta = de->temporary_pos + ".meta";
+		std::error_code ec;
+		if (de->noRanges) {
+			std::cout << "The server ignores the ranges or the file was changed, downloading as the whole: " << de->URL << "\n";
+			std::filesystem::remove(meta, ec);
+			std::filesystem::remove(de->temporary_pos, ec);
+			retry = true;
+		}
+		else if (de->segmentFailed) {
+			/// the finished segments stay in the file and in the meta file, the next run downloads only the rest
+			allOk = false;
+			std::cout << (de->canceled ? "Download canceled: " : "Download failed [network failure]: ") << de->URL << "\n";
+			if (de->error)de->error(de->canceled ? "Canceled" : "Download failed after all attempts");
+		}
+		else if (de->expected.empty() || (de->segmentsHashed == de->segmentsDone.size() && de->digest.final() == de->expected)) {
+			complete(de);
+			std::filesystem::remove(meta, ec);
+		}
+		else {
+			/// it is unknown which segment is broken, so all of them are downloaded again
+			std::filesystem::remove(meta, ec);
+			std::filesystem::remove(de->temporary_pos, ec);
+			allOk = false;
+			if (de->attempts < _retry_attempts) {
+				de->attempts++;
+				retry = true;
+			}
+			else {
+				if (de->error)de->error("ServerDataCorrupted");
+			}
+			std::cout << "Download failed [corrupted data]: " << de->URL;
+			if (retry)std::cout << " Re-trying, attempt #" << de->attempts;
+			std::cout << "\n";
+		}
+		if (retry) {
+			/// the next attempt counts the progress from the beginning
+			std::scoped_lock lock(m);
+			allSize -= de->size;
+			allDownloaded -= de->downloadedSize;
+			de->size = 0;
+			de->downloadedSize = 0;
 		}
+		return retry;
 	}
 
 	size_t queue::getProgress() {
@@ -225,4 +1293,23 @@ namespace downloader {
 		m.unlock();
 		return p;
 	}
+
+	std::pair<size_t, size_t> queue::getConnectionStats() {
+		m.lock();
+		std::pair<size_t, size_t> p(connectionsOpened, connectionsReused);
+		m.unlock();
+		return p;
+	}
+
+	size_t queue::getConcurrency() {
+		std::scoped_lock lock(m);
+		return _active_limit;
+	}
+
+	std::pair<size_t, size_t> queue::getRetryStats() {
+		m.lock();
+		std::pair<size_t, size_t> p(retries, backoffTime);
+		m.unlock();
+		return p;
+	}
 };
\ No newline at end of file
@@ -1,16 +1,94 @@
 #pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <ios>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <set>
 #include <string>
 #include <vector>
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 #include "httplib.h"
 #include "jcc.h"
+#include "md5.h"
 
 namespace downloader {
+	/**
+	 * \brief The token bucket shared by the downloads, it limits the overall download rate. The bucket holds a quarter of second of the rate,
+	 * so the short bursts are smoothed, but the idle time does not let the downloads exceed the rate later.
+	 */
+	class rate_limiter {
+		std::mutex m;
+		std::condition_variable changed;
+		size_t rate;
+		double tokens;
+		std::chrono::steady_clock::time_point last;
+	public:
+		rate_limiter(size_t bytes_per_second = 0);
+
+		/// Change the rate at any time, the waiting downloads follow the new rate at once. 0 means no limit.
+		void setRate(size_t bytes_per_second);
+
+		size_t getRate();
+
+		/// Wait till the bytes may be received. Called by the workers for every piece of the data.
+		void acquire(size_t bytes);
+	};
+
+	/**
+	 * \brief The output file of the download. The received pieces are small, so they are collected in the big buffer and written by
+	 * large blocks, and the disk space for the whole file may be reserved at once, so the file is not fragmented.
+	 */
+	class file_writer {
+		std::unique_ptr<char[]> buffer;
+		size_t used;
+		bool failed;
+#ifdef _WIN32
+		void* handle;
+#else
+		int fd;
+#endif
+		bool flush();
+	public:
+		/// the size of the block written to the disk
+		static constexpr size_t buffer_size = 1 << 20;
+		file_writer();
+		~file_writer();
+
+		/**
+		 * \brief Open the file for writing
+		 * \param path the file
+		 * \param offset the position to write from, the file is not truncated if it is not 0
+		 * \param truncate clear the file if the offset is 0
+		 */
+		bool open(const std::string& path, uint64_t offset, bool truncate);
+
+		/// Reserve the disk space for the file of the size, the file size is not changed. It is the hint, so the errors are ignored.
+		void reserve(uint64_t size);
+
+		void write(const char* data, size_t size);
+
+		/// Write the rest of the buffer and close, returns false if any write has failed
+		bool close();
+
+		bool is_open() const;
+	};
+
 	/// The class for the asyncronous downloading. Create the object, add items to download and do other job or wait till all downloads will be finished.
 	class queue {
 	public:
+		/// the order of the elements of the same priority
+		enum policy {
+			/// in the order of adding
+			fifo,
+			/// the biggest elements first, so the big file does not start at the end and the whole download ends sooner
+			largest_first,
+			/// the smallest elements first, so the most files are ready sooner
+			smallest_first
+		};
 		/**
 		 * \brief Construct the download queue
 		 * \param max_threads maximum dowloading threads
@@ -33,9 +111,66 @@ namespace downloader {
 		 * \param unzip need unzip after the downloading?
 		 * \param ready the ready callback
 		 * \param error the errors callback, called with the error message.
+		 * \param expected_md5 the md5 of the downloaded data (before the unzipping), it is calculated while the data arrives.
+		 * If it does not match, the download is retried at once, ready is called only for the verified data. Empty means no check.
+		 * \param expected_size the size of the downloaded data, if it is bigger than the segment size, the item is downloaded by segments. 0 means unknown.
+		 * \param priority the items with the higher priority are downloaded first, the policy orders the items of the same priority
 		 */
 		void add(const std::string& url, const std::string& to, bool unzip, std::function<void()> ready = nullptr,
-		         std::function<void(const std::string&)> error = nullptr);
+		         std::function<void(const std::string&)> error = nullptr, const std::string& expected_md5 = "", size_t expected_size = 0,
+		         int priority = 0);
+
+		/**
+		 * \brief Add the zipped item that is unzipped while it arrives, so the unzipped file is ready as soon as the download ends.
+		 * The unzipping needs the data in order, so the item is not downloaded by segments and the interrupted attempt starts from the beginning.
+		 * \param url the URL of the single-entry zip archive
+		 * \param to the filename for the unzipped file, it is written while the data arrives, so it should be the temporary name
+		 * \param keep the filename for the archive itself, it is written along with the unzipping. Empty means the archive is not kept.
+		 * \param ready the ready callback, called when both the archive and the unzipped data are verified
+		 * \param error the errors callback, called with the error message.
+		 * \param expected_md5 the md5 of the archive, empty means no check
+		 * \param expected_content_md5 the md5 of the unzipped data, empty means no check
+		 * \param expected_size the size of the archive, 0 means unknown
+		 * \param priority the items with the higher priority are downloaded first
+		 */
+		void addInflated(const std::string& url, const std::string& to, const std::string& keep, std::function<void()> ready = nullptr,
+		                 std::function<void(const std::string&)> error = nullptr, const std::string& expected_md5 = "",
+		                 const std::string& expected_content_md5 = "", size_t expected_size = 0, int priority = 0);
+
+		/// the part of the range added by addRange
+		struct piece {
+			/// the filename for the part, empty means the bytes are skipped
+			std::string to;
+			uint64_t length;
+			/// the md5 of the part, empty means no check
+			std::string expected_md5;
+		};
+
+		/**
+		 * \brief Add the byte range of the URL that is split into several files, so the small files stored one after another on the server
+		 * are downloaded by one request. Each part is verified and moved to its place as soon as it is received, the failed attempt
+		 * is continued from the first part that is not received yet.
+		 * \param url the URL to download
+		 * \param offset the first byte of the range
+		 * \param pieces the parts of the range in the order of the bytes
+		 * \param ready the ready callback, called when all the parts are received and verified
+		 * \param error the errors callback, called with the error message.
+		 * \param priority the items with the higher priority are downloaded first
+		 */
+		void addRange(const std::string& url, uint64_t offset, std::vector<piece> pieces, std::function<void()> ready = nullptr,
+		              std::function<void(const std::string&)> error = nullptr, int priority = 0);
+
+		/// Set the order of the items of the same priority, the default is fifo. The sizes are the expected sizes given to add.
+		void setPolicy(policy p);
+
+		/**
+		 * \brief Download the big items by segments. The file is allocated at once, the byte ranges of the segment size are downloaded
+		 * by the different workers at the same time, so one big file does not wait for the single connection while the other workers are idle.
+		 * If the server ignores the ranges, the item is downloaded as the whole. The finished segments are kept when the download
+		 * is interrupted, the next attempt (or the next run) downloads only the rest if the server confirms the file is the same.
+		 * \param segment_size the size of one segment, 0 disables the segmented download
+		 */
+		void setSegmentSize(size_t segment_size);
 
 		/// returns the overall progress
 		size_t getProgress();
@@ -43,30 +178,208 @@ namespace downloader {
 		/// returns the downloaded size and the total size to be downloaded as the pair
 		std::pair<size_t, size_t> getDownloadedSize();
 
+		/// returns the amount of the opened connections and the amount of the requests sent over the already opened connection as the pair
+		std::pair<size_t, size_t> getConnectionStats();
+
+		/// returns the amount of the retries and the overall pause before them in milliseconds as the pair
+		std::pair<size_t, size_t> getRetryStats();
+
+		/**
+		 * \brief Set how many network failures in a row the host may have. When it is exceeded, the downloads from the host fail without the
+		 * further attempts, so the unreachable server does not keep the queue for all the retries of every item. Any success resets the count.
+		 * \param failures the amount of the failures in a row, 0 means no limit. The default is twice the retry attempts.
+		 */
+		void setHostFailureBudget(size_t failures);
+
+		/**
+		 * \brief Change the amount of the simultaneous transfers automatically. Once per second the throughput is measured: while there are
+		 * the elements waiting, one more transfer is added, the network failures or the throughput drop after the increase halve the amount.
+		 * The amount given to the constructor is the initial one.
+		 * \param min_threads the minimal amount of the transfers
+		 * \param max_threads the maximal amount of the transfers
+		 */
+		void setAdaptive(size_t min_threads, size_t max_threads);
+
+		/// returns the current amount of the simultaneous transfers
+		size_t getConcurrency();
+
+		/**
+		 * \brief Download from the mirrors. The items which URL starts with one of the bases are downloaded from any mirror: the rest of the URL
+		 * is added to the mirror base. The preferred mirror is the first one, the failed attempt is retried on the next mirror,
+		 * the mirror that fails several times in a row is not used for a while.
+		 * Call it before adding the items.
+		 * \param bases the base URLs of the mirrors in the order of the preference
+		 */
+		void setMirrors(const std::vector<std::string>& bases);
+
+		/// Race the mirrors: the first item is requested from all the mirrors at once, the mirror that gives the first bytes sooner
+		/// becomes the preferred one. 0 (default) means no race, the first mirror is preferred.
+		void setRace(size_t bytes);
+
+		struct mirror_stats {
+			std::string base;
+			size_t requests;
+			size_t failures;
+			/// the average time till the response headers, milliseconds
+			double latency;
+		};
+
+		/// returns the requests, the failures and the latency of each mirror
+		std::vector<mirror_stats> getMirrorStats();
+
+		/// Limit the download rate, the limiter may be shared by several queues. It should live longer than the queue, nullptr means no limit.
+		void setRateLimiter(rate_limiter* limiter);
+
 	protected:
 		struct element {
 			std::string URL;
 			std::string temporary_pos;
 			std::string final_pos;
-			std::ofstream* output;
 			bool needUnzip;
-			bool remove;
 			size_t downloadedSize;
 			size_t size;
 			size_t attempts;
+			/// the element is not taken by the workers before this time, it is the pause before the retry
+			std::chrono::steady_clock::time_point notBefore;
+			std::string expected;
+			size_t expectedSize;
+			md5::context digest;
+			/// the parts of the element added by addRange, the range starts at rangeBegin, the first piecesDone parts are received
+			std::vector<piece> pieces;
+			size_t piecesDone;
+			/// the unzipped file of the element added by addInflated, the unzipped data is hashed while it is written
+			std::string content_pos;
+			std::string expectedContent;
+			md5::context contentDigest;
 			std::function<void()> ready;
 			std::function<void(const std::string&)> error;
+			/// the segment writes the bytes [rangeBegin, rangeEnd) to the temporary file of the parent
+			element* parent;
+			uint64_t rangeBegin;
+			uint64_t rangeEnd;
+			/// the segments of this element that are not finished yet
+			size_t segmentsLeft;
+			bool segmentFailed;
+			/// the finished segments and the validator of the file on the server are kept in the meta file, so the next run downloads only the rest
+			size_t segmentSize;
+			std::vector<bool> segmentsDone;
+			std::string validator;
+			/// the file is hashed in order while the segments from the beginning are finished, the first segmentsHashed are hashed already
+			size_t segmentsHashed;
+			bool hashing;
+			/// the server does not support the ranges, the element is downloaded as the whole
+			bool noRanges;
+			/// the progress callback has stopped the download, it is not retried and it is not the failure of the server
+			bool canceled;
+			int priority;
+			/// the order of adding
+			size_t seq;
+			/// the URL is the mirror base and the path, the mirror of the last attempt
+			bool mirrored;
+			std::string path;
+			size_t mirror;
+		};
+		struct mirror {
+			std::string base;
+			size_t requests;
+			size_t failures;
+			size_t failuresInRow;
+			double latency;
+			/// the mirror is not used till this time
+			std::chrono::steady_clock::time_point downUntil;
+		};
+		std::vector<mirror> mirrors;
+		size_t preferred;
+		size_t _race_bytes;
+		bool raced;
+		bool racing;
+		/// the workers of the mirrored elements sleep on raceOver while the race goes on, so they never take the wakeups of cv
+		std::condition_variable raceOver;
+		/// the order of the waiting elements: the priority, the segments of the element being downloaded, the policy, the order of adding
+		struct order {
+			policy p;
+			bool operator()(const element* a, const element* b) const;
 		};
 		std::mutex m;
 		std::mutex unz;
-		std::vector<element*> dqueue;
+		/// the elements waiting for the worker, the workers sleep on cv while it is empty
+		std::set<element*, order> dqueue{ order{ fifo } };
+		size_t sequence;
+		std::condition_variable cv;
+		/// the elements queued or being downloaded, the workers finish when it is zero after waitTheFinish
+		size_t pending;
 		std::vector<std::thread*> threads;
 		std::function<bool(size_t, size_t)> _progress;
+		rate_limiter* _limiter;
 		size_t _max_threads;
+		size_t _min_threads;
+		/// the workers are started up to this amount, the elements are taken while the active transfers are less
+		size_t _active_limit;
+		size_t active;
+		/// the throughput measurement of the adaptive mode
+		std::chrono::steady_clock::time_point windowStart;
+		size_t windowBytes;
+		size_t windowFailures;
+		double lastThroughput;
+		/// the limit was increased at the end of the previous period
+		bool raised;
 		size_t _retry_attempts;
+		size_t _segment_size;
+		size_t _host_failure_budget;
+		/// the network failures in a row for each host
+		std::map<std::string, size_t> hostFailures;
+		std::minstd_rand random;
+		size_t retries;
+		size_t backoffTime;
 		size_t allSize;
 		size_t allDownloaded;
+		size_t connectionsOpened;
+		size_t connectionsReused;
 		bool endall;
 		bool allOk;
+		/// each worker keeps the keep-alive client per host, so the connection and the TLS session are reused by the next downloads
+		typedef std::map<std::string, std::unique_ptr<httplib::Client>> clients;
+		void work();
+		/// the new element, it is not queued yet
+		element* create(const std::string& url, const std::string& to, std::function<void()> ready,
+		                std::function<void(const std::string&)> error, const std::string& expected_md5, size_t expected_size, int priority);
+		/// queue the created element
+		void enqueue(element* de);
+		/// one attempt to download the element, returns true if the element should be retried
+		bool download(element* de, clients& hosts);
+		/// allocate the file (or continue the one of the previous attempt) and queue the segments of the element, called under the lock.
+		/// Returns false if all the segments are finished already.
+		bool split(element* de);
+		/// one attempt to download the segment, returns true if the segment should be retried
+		bool downloadSegment(element* de, clients& hosts);
+		/// the segment is over, returns true if it was the last one and the worker should finish the whole element
+		bool segmentFinished(element* de);
+		/// hash the finished segments that follow the hashed ones, one worker at a time, called under the lock
+		void hashSegments(element* whole, std::unique_lock<std::mutex>& lock);
+		/// keep the finished segments in the meta file, called under the lock
+		void writeSegments(element* whole);
+		/// one attempt to download the parts of the range, returns true if the element should be retried
+		bool downloadPieces(element* de, clients& hosts);
+		/// called when the last segment is finished, checks the whole file, returns true if the element should be retried
+		bool finishSegmented(element* de);
+		/// move the verified file to its place (unzip if needed) and call the callbacks
+		void complete(element* de);
+		/// the keep-alive client for the server, counts the opened and the reused connections
+		httplib::Client& client(clients& hosts, const std::string& server);
+		bool reportProgress(element* de, uint64_t current, uint64_t total);
+		/// schedule the next attempt with the exponential backoff and the jitter, returns false if the attempts or the host failure budget are over
+		bool retryLater(element* de, const std::string& server, bool network);
+		void hostSucceeded(const std::string& server);
+		/// start the workers up to the active limit, but not more than the elements, called under the lock
+		void startWorkers();
+		/// the adaptive mode step, called under the lock
+		void adapt();
+		/// the URL for the next attempt of the element, the mirror is chosen if the element is mirrored
+		std::string pickUrl(element* de);
+		/// track the health and the latency of the mirror used for the attempt
+		void mirrorDone(element* de, bool ok, double latency);
+		/// the racers use the clients of the worker, so the connection to the fastest mirror is reused, they count as the active workers
+		void race(const std::string& path, clients& hosts);
+		static void splitUrl(const std::string& url, std::string& server, std::string& path);
 	};
 };
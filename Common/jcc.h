@@ -160,6 +160,31 @@ namespace jcc {
 	/// matches wildcards
 	inline bool wild_match(const std::string& str, const std::string& pat);
 
+	/**
+	 * \brief The list of wildcards compiled to the single automaton, the path is matched against all of them at once.
+	 * The path may be fed by pieces, so the state after the parent folder is reused for all its children.
+	 * Wildcards are the same as for the wild_match: '*' is any sequence, '?' is any char, '/' and '\\' are the same.
+	 */
+	class wild_matcher {
+		/// all patterns one after the other, each one ends with zero
+		std::string tokens;
+		/// true if only '*' remain till the end of the pattern
+		std::vector<bool> anyTail;
+		size_t words;
+		void activate(std::vector<uint64_t>& s, size_t pos) const;
+	public:
+		typedef std::vector<uint64_t> state;
+		wild_matcher(const std::vector<std::string>& patterns);
+		/// the state before the first char of the path
+		state start() const;
+		/// feed the next part of the path
+		void feed(state& s, const std::string& part) const;
+		/// true if the path fed so far matches any wildcard
+		bool matches(const state& s) const;
+		/// true if the path fed so far followed by anything matches, so the whole subfolder may be skipped
+		bool matchesAnyTail(const state& s) const;
+	};
+
 	/// reads the file into string and returns the string
 	std::string readFile(const std::string& fpath);
 
@@ -306,6 +331,75 @@ namespace jcc {
 		return str_it == str.end();
 	}
 
+	inline wild_matcher::wild_matcher(const std::vector<std::string>& patterns) {
+		for (auto& p : patterns) {
+			if (p.empty())continue;
+			for (char c : p) tokens += c == '\\' ? '/' : c;
+			tokens += '\0';
+		}
+		anyTail.resize(tokens.length() + 1, false);
+		for (size_t i = tokens.length(); i-- > 0;) {
+			anyTail[i] = tokens[i] == '*' && (tokens[i + 1] == '\0' || anyTail[i + 1]);
+		}
+		words = (tokens.length() + 63) / 64;
+	}
+
+	inline void wild_matcher::activate(std::vector<uint64_t>& s, size_t pos) const {
+		do {
+			s[pos >> 6] |= uint64_t(1) << (pos & 63);
+		} while (tokens[pos++] == '*');
+	}
+
+	inline wild_matcher::state wild_matcher::start() const {
+		state s(words, 0);
+		for (size_t i = 0; i < tokens.length(); i++) {
+			if (i == 0 || tokens[i - 1] == '\0')activate(s, i);
+		}
+		return s;
+	}
+
+	inline void wild_matcher::feed(state& s, const std::string& part) const {
+		state next(words);
+		for (char c : part) {
+			if (c == '\\')c = '/';
+			bool any = false;
+			std::fill(next.begin(), next.end(), 0);
+			for (size_t pos = 0; pos < tokens.length(); pos++) {
+				if (!s[pos >> 6]) {
+					pos |= 63;
+					continue;
+				}
+				if (s[pos >> 6] >> (pos & 63) & 1) {
+					char t = tokens[pos];
+					if (t == '*') {
+						activate(next, pos);
+						any = true;
+					}
+					else if (t != '\0' && (t == '?' || t == c)) {
+						activate(next, pos + 1);
+						any = true;
+					}
+				}
+			}
+			s.swap(next);
+			if (!any)break;
+		}
+	}
+
+	inline bool wild_matcher::matches(const state& s) const {
+		for (size_t pos = 0; pos < tokens.length(); pos++) {
+			if (tokens[pos] == '\0' && (s[pos >> 6] >> (pos & 63) & 1))return true;
+		}
+		return false;
+	}
+
+	inline bool wild_matcher::matchesAnyTail(const state& s) const {
+		for (size_t pos = 0; pos < tokens.length(); pos++) {
+			if (anyTail[pos] && (s[pos >> 6] >> (pos & 63) & 1))return true;
+		}
+		return false;
+	}
+
 	inline bool readSafeJsonFromString(json::JSON& dest, const std::string& string) {
 		std::string res = string;
 		if (res.length() > 34) {
@@ -1,22 +1,60 @@
 #pragma once
 
 #define LEFTROTATE(x, c) (((x) << (c)) | ((x) >> (32 - (c))))
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <memory>
+#include <string>
 
 namespace md5 {
-	inline void hash(const uint8_t* initial_msg, size_t initial_len, char* res) {
+	/// The buffer size used by the file_hash to stream the file content through the context.
+	constexpr size_t file_buffer_size = 1 << 18;
 
+	/**
+	 * \brief Incremental md5 calculation. Call init (or just construct), then update with the data pieces of any size, then final to get the hex digest.
+	 * The result is exactly the same as if all pieces were passed to the md5::hash at once.
+	 */
+	class context {
 		uint32_t h0, h1, h2, h3;
-		uint8_t* msg = NULL;
+		uint8_t block[64];
+		size_t blockLen;
+		uint64_t length;
+		void transform(const uint8_t* chunk);
+	public:
+		context();
+		/// reset the context to start the new digest
+		void init();
+		/// add the next piece of the data
+		void update(const void* data, size_t len);
+		/// finish the digest, writes 32 hex chars to res (without the trailing zero). The context should be re-initialized after this call.
+		void final(char* res);
+		/// finish the digest and return it as the hex string
+		std::string final();
+	};
+
+	inline context::context() {
+		init();
+	}
+
+	inline void context::init() {
+		h0 = 0x67452301;
+		h1 = 0xefcdab89;
+		h2 = 0x98badcfe;
+		h3 = 0x10325476;
+		blockLen = 0;
+		length = 0;
+	}
 
-		static uint32_t r[] = {
+	inline void context::transform(const uint8_t* chunk) {
+		static const uint32_t r[] = {
 			7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
 			5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
 			4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
 			6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
 		};
 
-		static uint32_t k[] = {
+		static const uint32_t k[] = {
 			0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
 			0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
 			0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
@@ -35,92 +73,131 @@ namespace md5 {
 			0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
 		};
 
-		h0 = 0x67452301;
-		h1 = 0xefcdab89;
-		h2 = 0x98badcfe;
-		h3 = 0x10325476;
+		uint32_t w[16];
+		for (int i = 0; i < 16; i++) {
+			const uint8_t* c = chunk + i * 4;
+			w[i] = uint32_t(c[0]) | (uint32_t(c[1]) << 8) | (uint32_t(c[2]) << 16) | (uint32_t(c[3]) << 24);
+		}
 
-		size_t new_len = ((((initial_len + 8) / 64) + 1) * 64) - 8;
-
-		msg = (uint8_t*)calloc(new_len + 64, 1);
-		memcpy(msg, initial_msg, initial_len);
-		msg[initial_len] = 128;
-		size_t bits_len = 8 * initial_len;
-		memcpy(msg + new_len, &bits_len, 4);
-
-		for (int offset = 0; offset < new_len; offset += (512 / 8)) {
-			uint32_t* w = (uint32_t*)(msg + offset);
-
-			uint32_t a = h0;
-			uint32_t b = h1;
-			uint32_t c = h2;
-			uint32_t d = h3;
-
-			uint32_t i;
-			for (i = 0; i < 64; i++) {
-				uint32_t f, g;
-				if (i < 16) {
-					f = (b & c) | ((~b) & d);
-					g = i;
-				}
-				else if (i < 32) {
-					f = (d & b) | ((~d) & c);
-					g = (5 * i + 1) % 16;
-				}
-				else if (i < 48) {
-					f = b ^ c ^ d;
-					g = (3 * i + 5) % 16;
-				}
-				else {
-					f = c ^ (b | (~d));
-					g = (7 * i) % 16;
-				}
-				uint32_t temp = d;
-				d = c;
-				c = b;
-				b = b + LEFTROTATE((a + f + k[i] + w[g]), r[i]);
-				a = temp;
+		uint32_t a = h0;
+		uint32_t b = h1;
+		uint32_t c = h2;
+		uint32_t d = h3;
+
+		for (uint32_t i = 0; i < 64; i++) {
+			uint32_t f, g;
+			if (i < 16) {
+				f = (b & c) | ((~b) & d);
+				g = i;
+			}
+			else if (i < 32) {
+				f = (d & b) | ((~d) & c);
+				g = (5 * i + 1) % 16;
+			}
+			else if (i < 48) {
+				f = b ^ c ^ d;
+				g = (3 * i + 5) % 16;
+			}
+			else {
+				f = c ^ (b | (~d));
+				g = (7 * i) % 16;
 			}
+			uint32_t temp = d;
+			d = c;
+			c = b;
+			b = b + LEFTROTATE((a + f + k[i] + w[g]), r[i]);
+			a = temp;
+		}
+
+		h0 += a;
+		h1 += b;
+		h2 += c;
+		h3 += d;
+	}
 
-			h0 += a;
-			h1 += b;
-			h2 += c;
-			h3 += d;
+	inline void context::update(const void* data, size_t len) {
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		length += len;
+		if (blockLen) {
+			size_t n = 64 - blockLen;
+			if (n > len)n = len;
+			memcpy(block + blockLen, p, n);
+			blockLen += n;
+			p += n;
+			len -= n;
+			if (blockLen < 64)return;
+			transform(block);
+			blockLen = 0;
+		}
+		while (len >= 64) {
+			transform(p);
+			p += 64;
+			len -= 64;
+		}
+		if (len) {
+			memcpy(block, p, len);
+			blockLen = len;
 		}
-		free(msg);
-		uint8_t bytes[16];
-		uint32_t* m5res = (uint32_t*)bytes;
-		m5res[0] = h0;
-		m5res[1] = h1;
-		m5res[2] = h2;
-		m5res[3] = h3;
+	}
+
+	inline void context::final(char* res) {
+		/// Only the low 32 bits of the length in bits are stored, the high part is zero.
+		/// It is not the standard md5 for data over 512 MB, but all heaps were created this way, so we keep it.
+		uint32_t bits = uint32_t(length * 8);
+		uint8_t tail[72];
+		memset(tail, 0, sizeof(tail));
+		tail[0] = 128;
+		size_t pad = (blockLen < 56 ? 56 : 120) - blockLen;
+		for (int i = 0; i < 4; i++) tail[pad + i] = uint8_t(bits >> (i * 8));
+		update(tail, pad + 8);
+
+		uint32_t m5res[4] = { h0, h1, h2, h3 };
 		const char* chars16 = "0123456789abcdef";
 		for (int i = 0, p = 0; i < 16; i++) {
-			uint8_t b = bytes[i];
+			uint8_t b = uint8_t(m5res[i >> 2] >> ((i & 3) * 8));
 			res[p++] = chars16[b >> 4];
 			res[p++] = chars16[b & 15];
 		}
 	}
 
+	inline std::string context::final() {
+		char c[33];
+		final(c);
+		c[32] = 0;
+		return std::string(c);
+	}
+
+	inline void hash(const uint8_t* initial_msg, size_t initial_len, char* res) {
+		context ctx;
+		ctx.update(initial_msg, initial_len);
+		ctx.final(res);
+	}
+
 	inline std::string hash(const uint8_t* initial_msg, size_t initial_len) {
 		char c[33];
 		hash(initial_msg, initial_len, c);
 		c[32] = 0;
 		return std::string(c);
 	}
-	
+
 	inline std::string hash(const std::string& s) {
 		return hash(reinterpret_cast<const uint8_t*>(s.c_str()), s.length());
 	}
 
+	/// md5 of the file content. The file is read by pieces, so the memory usage does not depend on the file size. Returns empty string if the file can't be read.
 	inline std::string file_hash(const std::string& path) {
-		size_t sz = std::filesystem::file_size(path);
 		std::ifstream f(path, std::ios::binary);
 		if (f.is_open()) {
-			char* u = new char[sz];
-			f.read(u, sz);
-			f.close();
-			return hash(reinterpret_cast<const uint8_t*>(u), sz);
+			std::unique_ptr<char[]> buf(new char[file_buffer_size]);
+			context ctx;
+			while (f) {
+				f.read(buf.get(), file_buffer_size);
+				std::streamsize n = f.gcount();
+				if (n <= 0)break;
+				ctx.update(buf.get(), size_t(n));
+			}
+			if (f.bad())return "";
+			return ctx.final();
 		}
 		return "";
 	}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tasks {
+
+	/// The simple pool of the worker threads. Add jobs, they are executed in parallel, the returned future tells when the job is done.
+	class pool {
+		std::mutex m;
+		std::condition_variable cv;
+		std::deque<std::function<void()>> jobs;
+		std::vector<std::thread> threads;
+		bool stop;
+		void work();
+	public:
+		/// Create the pool, 0 threads means the number of the CPU cores.
+		pool(size_t threads_count = 0);
+		/// Pending jobs are dropped, running jobs are finished before the destruction.
+		~pool();
+		/// Add the job to be executed by any free worker. The future rethrows the job's exception on get().
+		std::future<void> add(std::function<void()> job);
+		/// Drop all jobs that are not started yet.
+		void clear();
+		/// Amount of the worker threads.
+		size_t size();
+		/// The amount of threads that corresponds to the requested amount, 0 means the number of the CPU cores.
+		static size_t concurrency(size_t requested);
+	};
+
+	inline size_t pool::concurrency(size_t requested) {
+		if (requested == 0) requested = std::thread::hardware_concurrency();
+		return requested ? requested : 1;
+	}
+
+	inline pool::pool(size_t threads_count) {
+		stop = false;
+		threads_count = concurrency(threads_count);
+		for (size_t i = 0; i < threads_count; i++) {
+			threads.emplace_back([this] { work(); });
+		}
+	}
+
+	inline pool::~pool() {
+		{
+			std::scoped_lock lock(m);
+			jobs.clear();
+			stop = true;
+		}
+		cv.notify_all();
+		for (auto& t : threads) t.join();
+	}
+
+	inline void pool::work() {
+		do {
+			std::function<void()> job;
+			{
+				std::unique_lock lock(m);
+				cv.wait(lock, [this] { return stop || !jobs.empty(); });
+				if (jobs.empty()) break;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		} while (true);
+	}
+
+	inline std::future<void> pool::add(std::function<void()> job) {
+		auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+		std::future<void> f = task->get_future();
+		{
+			std::scoped_lock lock(m);
+			jobs.push_back([task] { (*task)(); });
+		}
+		cv.notify_one();
+		return f;
+	}
+
+	inline void pool::clear() {
+		std::scoped_lock lock(m);
+		jobs.clear();
+	}
+
+	inline size_t pool::size() {
+		return threads.size();
+	}
+}
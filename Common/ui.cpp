@@ -45,6 +45,7 @@ bool installerUi::start() {
 	//re-download root.json
 	{
 		downloader::queue q(1,5);
+		useMirrors(q);
 		std::string str = _servpath;
 		q.add(_servpath + "Versions/root.json", versionsPath.string(), false);
 		q.add(_servpath + "Versions/heap.dat", heapDat.string(), true);
@@ -114,6 +115,9 @@ bool installerUi::start() {
 	} while (ch);
 	/// download missing versions images
 	downloader::queue dq(4, 10);
+	dq.setAdaptive(_minConnections, _maxConnections);
+	dq.setRateLimiter(&limiter);
+	useMirrors(dq);
 	for (int i = 0; i < versions.size(); i++) {
 		if (versions[i].hasKey("Version")) {
 			std::string& set_version = versions[i]["Version"].ToString();
@@ -179,6 +183,11 @@ bool installerUi::start() {
 			if (in.at("request") == "stop") {
 				shouldStop = true;
 			}
+			if (in.at("request") == "ratelimit") {
+				/// KB per second, 0 removes the limit
+				if (in.hasKey("RateLimit"))setRateLimit(size_t(in.at("RateLimit").ToInt()) * 1024);
+				res["RateLimit"] = long(limiter.getRate() / 1024);
+			}
 			if (in.at("request") == "setimage") {
 				if (in.hasKey("Version") && !syncStarted) {
 					progress_percent = "0";
@@ -3,9 +3,12 @@
 
 #pragma once
 
+#include <algorithm>
 #include <functional>
 #include <iostream>
 #include <filesystem>
+#include <fstream>
+#include <memory>
 #include <cstring>
 
 #define MINIZ_HEADER_FILE_ONLY
@@ -36,6 +39,27 @@ namespace zpp {
 
 	void createPathForFile(const std::string&);
 
+	/// receives the data pieces from packFile
+	typedef std::function<void(const void* data, size_t length)> data_callback;
+
+	/**
+	 * \brief Pack one file into the new single-entry archive reading the source only once and writing the archive sequentially.
+	 * The crc and the sizes follow the compressed data in the data descriptor, so nothing is rewritten after the data.
+	 * Every piece of the source is passed to onSource and every piece of the archive is passed to onArchive, so the caller may hash both on the fly.
+	 * The entry has no modification time, the archive depends only on the content and the name.
+	 * Returns false if something failed or the file is over 4 GB (there is no zip64), the archive should be removed then.
+	 */
+	bool packFile(const std::string& filename, const std::string& destArchiveName, const std::string& nameInArchive,
+		const data_callback& onSource = nullptr, const data_callback& onArchive = nullptr);
+
+	/// The same as packFile, but the source is read from the stream
+	bool packStream(std::istream& src, const std::string& destArchiveName, const std::string& nameInArchive,
+		const data_callback& onSource = nullptr, const data_callback& onArchive = nullptr);
+
+	/// The same as packFile, but the source is the data in the memory
+	bool packData(const void* data, size_t length, const std::string& destArchiveName, const std::string& nameInArchive,
+		const data_callback& onArchive = nullptr);
+
 	/// The simple c++ interface to extract ZIP files
 	class reader {
 		mz_zip_archive ar;
@@ -58,6 +82,39 @@ namespace zpp {
 		void extractAll(const std::string& destFolder);
 		/// Extract the first file in the archive to the destination filename. It is useful if you have just one file in the archive.
 		void extractFirstToFile(const std::string& destFilename);
+		/// Extract the first file in the archive to the destination filename passing every written piece to onData, so the caller may hash it on the fly.
+		/// Returns false if the archive is broken or the file can't be written.
+		bool extractFirstToFile(const std::string& destFilename, const data_callback& onData);
+		/// Unzip the first file in the archive passing every piece to onData only, nothing is written. Returns false if the archive is broken.
+		bool extractFirst(const data_callback& onData);
+		/// The unzipped size of the first file in the archive, returns false if the archive is broken or empty.
+		bool firstFileSize(uint64_t& size);
+	};
+
+	/**
+	 * \brief Unzip the first entry of the archive while the archive arrives by pieces, so the archive is not stored anywhere.
+	 * The deflated entry ends with the deflate stream itself, so the sizes may follow the data in the data descriptor.
+	 * The stored entry should have the size in the local header. Everything after the first entry is ignored.
+	 */
+	class inflater {
+		data_callback onData;
+		std::string header;
+		size_t headerSize;
+		uint16_t method;
+		uint64_t storedLeft;
+		bool finished;
+		bool failed;
+		std::unique_ptr<tinfl_decompressor> decomp;
+		std::unique_ptr<mz_uint8[]> dict;
+		size_t dictOffset;
+		bool parseHeader();
+	public:
+		/// onData receives every unzipped piece
+		inflater(data_callback onData);
+		/// Pass the next piece of the archive, returns false if the archive is broken or not supported
+		bool feed(const void* data, size_t length);
+		/// returns true if the whole entry is unzipped
+		bool done() const;
 	};
 
 	inline writer::writer(const std::string& destArchiveName) {
@@ -129,9 +186,10 @@ namespace zpp {
 	}
 
 	inline reader::reader(const std::string& archiveName) {
+		std::memset(&ar, 0, sizeof(ar));
+		errors = true;
 		std::filesystem::directory_entry d(archiveName);
 		if (exists(d)) {
-			std::memset(&ar, 0, sizeof(ar));
 			/// hack - waiting for the file to be closed if it was created by fstream.
 			/// If stream is closed, the fopen still can't open the file immediately.
 			/// c++ uses fstream, but unzipper uses FILE*, so this hack introduced to resolve the conflict
@@ -225,4 +283,254 @@ namespace zpp {
 			mz_zip_reader_extract_to_file(&ar, 0, destFilename.c_str(), 0);
 		}
 	}
+
+	inline bool reader::extractFirstToFile(const std::string& destFilename, const data_callback& onData) {
+		if (errors || mz_zip_reader_get_num_files(&ar) == 0)return false;
+		createPathForFile(destFilename);
+		std::ofstream f(destFilename, std::ios::binary | std::ios::trunc);
+		if (!f.is_open())return false;
+		struct target {
+			std::ofstream* file;
+			const data_callback* onData;
+			static size_t write(void* opaque, mz_uint64, const void* buf, size_t n) {
+				target* t = static_cast<target*>(opaque);
+				t->file->write(static_cast<const char*>(buf), n);
+				if (*t->onData)(*t->onData)(buf, n);
+				return t->file->good() ? n : 0;
+			}
+		};
+		target t{ &f, &onData };
+		bool ok = mz_zip_reader_extract_to_callback(&ar, 0, &target::write, &t, 0);
+		f.close();
+		return ok && !f.fail();
+	}
+
+	inline bool reader::extractFirst(const data_callback& onData) {
+		if (errors || mz_zip_reader_get_num_files(&ar) == 0)return false;
+		struct target {
+			static size_t write(void* opaque, mz_uint64, const void* buf, size_t n) {
+				(*static_cast<const data_callback*>(opaque))(buf, n);
+				return n;
+			}
+		};
+		return mz_zip_reader_extract_to_callback(&ar, 0, &target::write, const_cast<data_callback*>(&onData), 0);
+	}
+
+	inline bool reader::firstFileSize(uint64_t& size) {
+		mz_zip_archive_file_stat st;
+		if (errors || mz_zip_reader_get_num_files(&ar) == 0 || !mz_zip_reader_file_stat(&ar, 0, &st))return false;
+		size = st.m_uncomp_size;
+		return true;
+	}
+
+	inline bool packFile(const std::string& filename, const std::string& destArchiveName, const std::string& nameInArchive,
+		const data_callback& onSource, const data_callback& onArchive) {
+		std::ifstream src(filename, std::ios::binary);
+		if (!src.is_open())return false;
+		return packStream(src, destArchiveName, nameInArchive, onSource, onArchive);
+	}
+
+	inline bool packData(const void* data, size_t length, const std::string& destArchiveName, const std::string& nameInArchive,
+		const data_callback& onArchive) {
+		/// the stream reads the memory directly, nothing is copied
+		struct memory : std::streambuf {
+			memory(char* p, size_t n) {
+				setg(p, p, p + n);
+			}
+		};
+		memory buf(static_cast<char*>(const_cast<void*>(data)), length);
+		std::istream src(&buf);
+		return packStream(src, destArchiveName, nameInArchive, nullptr, onArchive);
+	}
+
+	inline bool packStream(std::istream& src, const std::string& destArchiveName, const std::string& nameInArchive,
+		const data_callback& onSource, const data_callback& onArchive) {
+		const size_t bufferSize = 1 << 18;
+		const uint32_t localSig = 0x04034b50;
+		const uint32_t descriptorSig = 0x08074b50;
+		const uint32_t centralSig = 0x02014b50;
+		const uint32_t endSig = 0x06054b50;
+		/// the version needed to extract, the deflate and the data descriptor flag, the DOS date 1980-01-01
+		const uint16_t version = 20;
+		const uint16_t flags = 8;
+		const uint16_t method = MZ_DEFLATED;
+		const uint16_t dosTime = 0;
+		const uint16_t dosDate = (1 << 5) | 1;
+		if (nameInArchive.length() > 0xFFFF)return false;
+		createPathForFile(destArchiveName);
+		std::ofstream dst(destArchiveName, std::ios::binary | std::ios::trunc);
+		if (!dst.is_open())return false;
+		uint64_t written = 0;
+		data_callback out = [&](const void* data, size_t length) {
+			dst.write(static_cast<const char*>(data), length);
+			written += length;
+			if (onArchive)onArchive(data, length);
+		};
+		auto le = [](std::string& s, uint32_t v, int bytes) {
+			for (int i = 0; i < bytes; i++)s += char((v >> (i * 8)) & 255);
+		};
+		std::string h;
+		le(h, localSig, 4);
+		le(h, version, 2);
+		le(h, flags, 2);
+		le(h, method, 2);
+		le(h, dosTime, 2);
+		le(h, dosDate, 2);
+		/// crc and sizes are in the data descriptor
+		le(h, 0, 4);
+		le(h, 0, 4);
+		le(h, 0, 4);
+		le(h, uint32_t(nameInArchive.length()), 2);
+		le(h, 0, 2);
+		h += nameInArchive;
+		out(h.data(), h.length());
+
+		struct sink {
+			static mz_bool put(const void* buf, int len, void* user) {
+				(*static_cast<data_callback*>(user))(buf, size_t(len));
+				return MZ_TRUE;
+			}
+		};
+		std::unique_ptr<tdefl_compressor> comp(new tdefl_compressor);
+		if (tdefl_init(comp.get(), &sink::put, &out, tdefl_create_comp_flags_from_zip_params(MZ_BEST_COMPRESSION, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY)) != TDEFL_STATUS_OKAY) {
+			return false;
+		}
+		std::unique_ptr<char[]> buf(new char[bufferSize]);
+		mz_ulong crc = MZ_CRC32_INIT;
+		uint64_t size = 0;
+		uint64_t dataStart = written;
+		while (src) {
+			src.read(buf.get(), bufferSize);
+			std::streamsize n = src.gcount();
+			if (n <= 0)break;
+			if (onSource)onSource(buf.get(), size_t(n));
+			crc = mz_crc32(crc, reinterpret_cast<const mz_uint8*>(buf.get()), size_t(n));
+			size += uint64_t(n);
+			if (size > 0xFFFFFFFF || tdefl_compress_buffer(comp.get(), buf.get(), size_t(n), TDEFL_NO_FLUSH) != TDEFL_STATUS_OKAY)return false;
+		}
+		if (src.bad() || tdefl_compress_buffer(comp.get(), nullptr, 0, TDEFL_FINISH) != TDEFL_STATUS_DONE)return false;
+		uint64_t compressed = written - dataStart;
+		if (compressed > 0xFFFFFFFF)return false;
+
+		std::string t;
+		le(t, descriptorSig, 4);
+		le(t, uint32_t(crc), 4);
+		le(t, uint32_t(compressed), 4);
+		le(t, uint32_t(size), 4);
+		size_t central = t.length();
+		le(t, centralSig, 4);
+		le(t, version, 2);
+		le(t, version, 2);
+		le(t, flags, 2);
+		le(t, method, 2);
+		le(t, dosTime, 2);
+		le(t, dosDate, 2);
+		le(t, uint32_t(crc), 4);
+		le(t, uint32_t(compressed), 4);
+		le(t, uint32_t(size), 4);
+		le(t, uint32_t(nameInArchive.length()), 2);
+		/// extra, comment, disk number, internal and external attributes, local header offset
+		le(t, 0, 2);
+		le(t, 0, 2);
+		le(t, 0, 2);
+		le(t, 0, 2);
+		le(t, 0, 4);
+		le(t, 0, 4);
+		t += nameInArchive;
+		uint64_t centralOffset = written + central;
+		uint32_t centralSize = uint32_t(t.length() - central);
+		if (centralOffset + centralSize > 0xFFFFFFFF)return false;
+		le(t, endSig, 4);
+		le(t, 0, 2);
+		le(t, 0, 2);
+		le(t, 1, 2);
+		le(t, 1, 2);
+		le(t, centralSize, 4);
+		le(t, uint32_t(centralOffset), 4);
+		le(t, 0, 2);
+		out(t.data(), t.length());
+		dst.close();
+		return !dst.fail();
+	}
+
+	inline inflater::inflater(data_callback onData) : onData(std::move(onData)) {
+		headerSize = 0;
+		method = 0;
+		storedLeft = 0;
+		finished = false;
+		failed = false;
+		dictOffset = 0;
+	}
+
+	inline bool inflater::parseHeader() {
+		const uint8_t* h = reinterpret_cast<const uint8_t*>(header.data());
+		auto le = [h](size_t pos, int bytes) {
+			uint32_t v = 0;
+			for (int i = bytes - 1; i >= 0; i--)v = (v << 8) | h[pos + i];
+			return v;
+		};
+		const uint32_t localSig = 0x04034b50;
+		const uint16_t encrypted = 1;
+		const uint16_t descriptor = 8;
+		if (le(0, 4) != localSig || (le(6, 2) & encrypted))return false;
+		method = uint16_t(le(8, 2));
+		if (method == MZ_DEFLATED) {
+			decomp.reset(new tinfl_decompressor);
+			tinfl_init(decomp.get());
+			dict.reset(new mz_uint8[TINFL_LZ_DICT_SIZE]);
+		}
+		else if (method == 0 && !(le(6, 2) & descriptor)) {
+			storedLeft = le(18, 4);
+			finished = storedLeft == 0;
+		}
+		else return false;
+		headerSize = 30 + le(26, 2) + le(28, 2);
+		return true;
+	}
+
+	inline bool inflater::feed(const void* data, size_t length) {
+		const mz_uint8* in = static_cast<const mz_uint8*>(data);
+		while (length && !failed && (!headerSize || header.length() < headerSize)) {
+			/// the fixed part of the local header, then the name and the extra field
+			size_t need = (headerSize ? headerSize : 30) - header.length();
+			size_t n = std::min(need, length);
+			header.append(reinterpret_cast<const char*>(in), n);
+			in += n;
+			length -= n;
+			if (!headerSize && header.length() == 30 && !parseHeader())failed = true;
+		}
+		if (failed)return false;
+		if (!headerSize || header.length() < headerSize || finished)return true;
+		if (method == 0) {
+			size_t n = size_t(std::min<uint64_t>(storedLeft, length));
+			if (n)onData(in, n);
+			storedLeft -= n;
+			finished = storedLeft == 0;
+			return true;
+		}
+		tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+		while (length || status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+			size_t inSize = length;
+			size_t outSize = TINFL_LZ_DICT_SIZE - dictOffset;
+			status = tinfl_decompress(decomp.get(), in, &inSize, dict.get(), dict.get() + dictOffset, &outSize, TINFL_FLAG_HAS_MORE_INPUT);
+			in += inSize;
+			length -= inSize;
+			if (outSize)onData(dict.get() + dictOffset, outSize);
+			/// the output wraps around the dictionary
+			dictOffset = (dictOffset + outSize) & (TINFL_LZ_DICT_SIZE - 1);
+			if (status == TINFL_STATUS_DONE) {
+				finished = true;
+				break;
+			}
+			if (status < TINFL_STATUS_DONE) {
+				failed = true;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	inline bool inflater::done() const {
+		return finished && !failed;
+	}
 }
\ No newline at end of file